@@ -0,0 +1,52 @@
+/*
+ * Definitions for the PC BIOS system address map interface
+ * (INT 0x15, EAX=0xE820), which reports the physical memory map.
+ * The boot loader (boot/boot.S) queries it while still in real mode
+ * and leaves the results in low memory for the kernel's mem_init().
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_E820_H
+#define PIOS_DEV_E820_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#define E820_SMAP	0x534d4150	// 'SMAP' signature in EAX and EDX
+#define E820_ENTSIZE	20		// size of one address map entry
+
+// Where the boot loader leaves the map: in page 0,
+// just past the BIOS data area, which mem_init() never allocates.
+#define E820_MAP	0x500		// e820map struct
+#define E820_MAPMAX	0x1000		// end of space available for the map
+
+// Address range types
+#define E820_RAM	1		// usable RAM
+#define E820_RESERVED	2		// reserved: don't touch
+#define E820_ACPI	3		// ACPI tables: reclaimable after parsing
+#define E820_NVS	4		// ACPI non-volatile storage
+#define E820_UNUSABLE	5		// RAM with detected errors
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/cdefs.h>
+
+// One entry in the BIOS address map.
+typedef struct e820entry {
+	uint64_t	addr;		// start of range
+	uint64_t	len;		// length of range in bytes
+	uint32_t	type;		// E820_RAM, etc.
+} gcc_packed e820entry;
+
+// The table boot/boot.S builds at E820_MAP.
+typedef struct e820map {
+	uint16_t	nbytes;		// bytes of entries that follow
+	uint16_t	padding;
+	e820entry	ent[0];
+} e820map;
+
+#endif	// !__ASSEMBLER__
+
+#endif	// !PIOS_DEV_E820_H
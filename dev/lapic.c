@@ -0,0 +1,211 @@
+/*
+ * Device driver code for the processor's local APIC.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Adapted from xv6 and PIOS.
+ */
+
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+
+#include <dev/lapic.h>
+#include <dev/nvram.h>
+
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define X1         0x0000000B   // divide counts by 1
+	#define PERIODIC   0x00020000   // Periodic
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+
+#define LAPIC_ADDR	0xFEE00000	// Default physical address
+#define CPUID_APIC	0x00000200	// cpuid(1) edx: local APIC present
+
+volatile uint32_t *lapic;
+
+// Timer counts per millisecond, measured by the first lapic_timer() call.
+// All the CPUs' timers run off the same bus clock,
+// so if several measure it at once, it doesn't matter whose result sticks.
+static uint32_t lapic_tickspms;
+
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+void
+lapic_init(void)
+{
+	// Without an MP table to tell us where it is (see mp_init()),
+	// look for the local APIC at its default address.
+	if (cpu_onboot() && lapic == NULL) {
+		cpuinfo inf;
+		cpuid(1, &inf);
+		if (inf.edx & CPUID_APIC)
+			lapic = (volatile uint32_t *) LAPIC_ADDR;
+	}
+	if (!lapic)
+		return;
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
+
+	// Leave the timer masked until something needs it.
+	lapicw(TIMER, MASKED | T_LTIMER);
+
+	// Disable logical interrupt lines.
+	// This also shuts out the legacy 8259 PIC, which isn't set up.
+	lapicw(LINT0, MASKED);
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Map error interrupt to T_LERROR.
+	lapicw(ERROR, T_LERROR);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Send an Init Level De-Assert to synchronise arbitration ID's.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, BCAST | INIT | LEVEL);
+	while(lapic[ICRLO] & DELIVS)
+		;
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+
+	cpu_cur()->id = lapic[ID] >> 24;
+}
+
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+void
+lapic_errintr(void)
+{
+	lapic_eoi();	// Acknowledge interrupt
+	lapicw(ESR, 0);	// Trigger update of ESR by writing anything
+	warn("CPU%d LAPIC error: ESR %x", cpu_cur()->id, lapic[ESR]);
+}
+
+// Spin for about the given number of microseconds.
+// A read from an unused ISA port takes about a microsecond
+// on any PC, without our having to calibrate anything.
+static void
+microdelay(int us)
+{
+	while (us-- > 0)
+		inb(0x84);
+}
+
+// Start additional processor running bootstrap code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startcpu(uint8_t apicid, uint32_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t*)(0x40<<4 | 0x67);  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapicw(ICRHI, apicid<<24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	microdelay(200);
+	lapicw(ICRLO, INIT | LEVEL);
+	microdelay(10000);
+
+	// Send startup IPI (twice!) to enter bootstrap code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	for(i = 0; i < 2; i++){
+		lapicw(ICRHI, apicid<<24);
+		lapicw(ICRLO, STARTUP | (addr>>12));
+		microdelay(200);
+	}
+}
+
+void
+lapic_timer(int hz)
+{
+	if (!lapic)
+		return;
+
+	// Count down from the top for a while to see how fast the timer runs.
+	// microdelay() is only roughly right, and so are the timeslices.
+	if (lapic_tickspms == 0) {
+		lapicw(TDCR, X1);
+		lapicw(TIMER, MASKED | T_LTIMER);
+		lapicw(TICR, 0xffffffff);
+		microdelay(10000);
+		lapic_tickspms = (0xffffffff - lapic[TCCR]) / 10;
+		assert(lapic_tickspms > 0);
+	}
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | T_LTIMER);
+	lapicw(TICR, lapic_tickspms * 1000 / hz);
+}
+
+void
+lapic_ipi(uint8_t apicid, int vec)
+{
+	assert(lapic);
+
+	// Wait for any earlier IPI from this CPU to go out,
+	// then aim and fire: writing the low word sends it.
+	while (lapic[ICRLO] & DELIVS)
+		pause();
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, vec);
+}
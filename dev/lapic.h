@@ -0,0 +1,45 @@
+/*
+ * Definitions for the processor's local APIC (Advanced Programmable
+ * Interrupt Controller), through which each CPU takes its own timer,
+ * error, and inter-processor interrupts.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Adapted from xv6 and PIOS.
+ */
+
+#ifndef PIOS_DEV_LAPIC_H
+#define PIOS_DEV_LAPIC_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// The local APIC's registers, memory-mapped at its default physical address;
+// NULL if the processor doesn't have one.
+extern volatile uint32_t *lapic;
+
+// Enable the current CPU's local APIC and record its APIC ID in cpu_cur().
+// Call after mp_init(), which may find it somewhere other than the default.
+void lapic_init(void);
+
+// Acknowledge the interrupt currently being handled.
+void lapic_eoi(void);
+
+// Handle a local APIC error interrupt.
+void lapic_errintr(void);
+
+// Start the current CPU's timer interrupting it on T_LTIMER 'hz' times a second.
+void lapic_timer(int hz);
+
+// Send interrupt vector 'vec' to the CPU whose local APIC ID is 'apicid'.
+void lapic_ipi(uint8_t apicid, int vec);
+
+// Start the processor whose local APIC ID is 'apicid'
+// running the real-mode bootstrap code at 'addr',
+// which must be page-aligned and below 1MB.
+void lapic_startcpu(uint8_t apicid, uint32_t addr);
+
+#endif	// !PIOS_DEV_LAPIC_H
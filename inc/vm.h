@@ -0,0 +1,43 @@
+/*
+ * Virtual memory layout definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_INC_VM_H
+#define PIOS_INC_VM_H
+
+// Virtual memory layout:
+//
+//	4GB ---------->	+-------------------------------+
+//			|  I/O devices (LAPIC, IOAPIC)  |
+//			|  mapped at their own address  |
+//			+-------------------------------+ 0xF0400000
+//			| current page tables (vpt[])   |
+//	VM_USERHI --->	+-------------------------------+ 0xF0000000
+//	  = VM_VPT
+//			|                               |
+//			|      user address space       |
+//			|                               |
+//	VM_USERLO --->	+-------------------------------+ 0x40000000
+//			|  all usable physical memory,  |
+//			|  mapped at its own address    |
+//	0 ------------>	+-------------------------------+
+//
+// The kernel's mappings outside the user address space are the same
+// in every page directory, so they use global 4MB pages
+// that stay in the TLB across page directory switches.
+// User code can't touch them: it gets pages of its own in user space.
+// The exception is VM_VPT, where each page directory maps itself
+// as if it were a page table (see kern/pmap.h).
+// The kernel uses only physical memory it can reach through that mapping,
+// so any RAM above VM_USERLO (1GB) is left unused, whatever the BIOS reports.
+
+#define VM_USERLO	0x40000000	// Start of user address space
+#define VM_USERHI	0xF0000000	// End of user address space
+#define VM_VPT		0xF0000000	// Recursive mapping of page tables
+
+#endif /* !PIOS_INC_VM_H */
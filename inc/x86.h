@@ -47,6 +47,10 @@ typedef struct cpuinfo {
 	uint32_t	ecx;
 } cpuinfo;
 
+// Feature bits in cpuinfo.edx for CPUID leaf 1
+#define CPUID_PSE	0x00000008	// 4MB pages
+#define CPUID_PGE	0x00002000	// Global pages
+
 
 
 static gcc_inline void
@@ -311,13 +315,52 @@ xadd(volatile uint32_t *addr, int32_t incr)
 	int32_t result;
 
 	// The + in "+m" denotes a read-modify-write operand.
-	asm volatile("lock; xaddl %0, %1" :
-	       "+m" (*addr), "=a" (result) :
+	asm volatile("lock; xaddl %1, %0" :
+	       "+m" (*addr), "=r" (result) :
 	       "1" (incr) :
 	       "cc");
 	return result;
 }
 
+// Atomically compare *addr with 'expected' and, if they are equal,
+// replace it with 'newval'.  Returns the old value of *addr.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t expected, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0" :
+	       "+m" (*addr), "=a" (result) :
+	       "r" (newval), "1" (expected) :
+	       "memory", "cc");
+	return result;
+}
+
+// Atomically compare the 64-bit value at *addr with 'expected' and,
+// if they are equal, replace it with 'newval'.
+// Returns the old value of *addr, which equals 'expected' on success.
+// The 32-bit halves of a 64-bit load are not read atomically,
+// but a torn value can only make the comparison fail, never falsely succeed.
+static inline uint64_t
+cmpxchg8b(volatile uint64_t *addr, uint64_t expected, uint64_t newval)
+{
+	uint64_t result = expected;
+
+	asm volatile("lock; cmpxchg8b %0" :
+	       "+m" (*addr), "+A" (result) :
+	       "b" ((uint32_t) newval), "c" ((uint32_t) (newval >> 32)) :
+	       "memory", "cc");
+	return result;
+}
+
+// Make all earlier stores visible to other CPUs before any later load.
+// A locked instruction does this on every x86, even those without MFENCE.
+static inline void
+mfence(void)
+{
+	asm volatile("lock; addl $0,(%%esp)" : : : "memory", "cc");
+}
+
 static inline void
 pause(void)
 {
@@ -333,6 +376,25 @@ cpuid(uint32_t idx, cpuinfo *info)
 		: "a" (idx));
 }
 
+// Return the bit number of the lowest set bit in a nonzero word.
+static gcc_inline uint32_t
+bsf(uint32_t word)
+{
+	uint32_t idx;
+	asm("bsfl %1,%0" : "=r" (idx) : "rm" (word));
+	return idx;
+}
+
+// Like cpuid(), for leaves that take a subleaf number in ECX.
+static gcc_inline void
+cpuid_sub(uint32_t idx, uint32_t sub, cpuinfo *info)
+{
+	asm volatile("cpuid" 
+		: "=a" (info->eax), "=b" (info->ebx),
+		  "=c" (info->ecx), "=d" (info->edx)
+		: "a" (idx), "c" (sub));
+}
+
 static gcc_inline uint64_t
 rdtsc(void)
 {
@@ -355,6 +417,15 @@ cli(void)
 	asm volatile("cli");
 }
 
+// Enable interrupts and halt until one arrives.
+// STI takes effect only after the next instruction,
+// so no interrupt can slip in between and leave us asleep.
+static gcc_inline void
+sti_hlt(void)
+{
+	asm volatile("sti; hlt" : : : "memory");
+}
+
 
 
 #endif /* !PIOS_INC_X86_H */
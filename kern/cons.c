@@ -21,6 +21,7 @@
 #include <kern/cpu.h>
 #include <kern/cons.h>
 #include <kern/mem.h>
+#include <kern/spinlock.h>
 
 #include <dev/video.h>
 #include <dev/kbd.h>
@@ -43,6 +44,9 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// Serializes console output among CPUs.
+static spinlock cons_lock;
+
 
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
@@ -100,6 +104,7 @@ cons_init(void)
 	if (!cpu_onboot())	// only do once, on the boot CPU
 		return;
 
+	spinlock_init(&cons_lock);
 	video_init();
 	kbd_init();
 	serial_init();
@@ -113,9 +118,18 @@ cons_init(void)
 void
 cputs(const char *str)
 {
+	// Keep output from different CPUs from getting mixed together,
+	// though a panic while printing must still be able to print.
+	bool lock = !spinlock_holding(&cons_lock);
+	if (lock)
+		spinlock_acquire(&cons_lock);
+
 	char ch;
 	while (*str)
 		cons_putc(*str++);
+
+	if (lock)
+		spinlock_release(&cons_lock);
 }
 
 
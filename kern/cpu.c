@@ -15,6 +15,8 @@
 #include <kern/cpu.h>
 #include <kern/init.h>
 
+#include <dev/lapic.h>
+
 
 
 cpu cpu_boot = {
@@ -57,13 +59,26 @@ cpu cpu_boot = {
  		 //c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
 	},
 
+	percpu: __start_percpu,
+
 	magic: CPU_MAGIC
 };
 
+// The boot CPU uses the percpu section in place,
+// so this copy is the one that points to cpu_boot.
+PERCPU cpu *cpu_self = &cpu_boot;
+
 
 void cpu_init()
 {
-	cpu *c = cpu_cur();
+	cpu *c = (cpu*)ROUNDDOWN(read_esp(), PAGESIZE);
+	assert(c->magic == CPU_MAGIC);
+
+	// Base the per-CPU segment so that %gs:&var is this CPU's copy of var.
+	// Offsets wrap around modulo 2^32, so the base may be "negative".
+	c->gdt[CPU_GDT_KPERCPU >> 3] = SEGDESC32(1, STA_W,
+			(uint32_t) c->percpu - (uint32_t) __start_percpu,
+			0xffffffff, 0);
 
 	// Load the GDT
 	struct pseudodesc gdt_pd = {
@@ -71,7 +86,7 @@ void cpu_init()
 	asm volatile("lgdt %0" : : "m" (gdt_pd));
 
 	// Reload all segment registers.
-	asm volatile("movw %%ax,%%gs" :: "a" (CPU_GDT_UDATA|3));
+	asm volatile("movw %%ax,%%gs" :: "a" (CPU_GDT_KPERCPU));
 	asm volatile("movw %%ax,%%fs" :: "a" (CPU_GDT_UDATA|3));
 	asm volatile("movw %%ax,%%es" :: "a" (CPU_GDT_KDATA));
 	asm volatile("movw %%ax,%%ds" :: "a" (CPU_GDT_KDATA));
@@ -89,7 +104,89 @@ void cpu_init()
 	c->tss.ts_esp0 = (uintptr_t)(c->kstackhi);
 	c->gdt[CPU_GDT_TSS >> 3] = SEGDESC16(0,STS_T32A,(uintptr_t)(&c->tss),sizeof(c->tss)-1,0);
 	ltr(CPU_GDT_TSS);
+
+	spinlock_init(&c->tlblock);
+	spinlock_init(&c->rqlock);
 	
 }
 
+// Tail of the list of all CPUs, for cpu_alloc() to append to.
+static cpu **cpu_tail = &cpu_boot.next;
+
+cpu *
+cpu_alloc(void)
+{
+	// Give each CPU's struct and stack page the next cache color
+	// after the last one's, so that all the CPUs' hottest data
+	// doesn't land in the same few sets of a shared cache.
+	cpu *last = (cpu *) ((char *) cpu_tail - offsetof(cpu, next));
+	int color = (mem_color(mem_ptr2pi(last)) + 1) & (mem_ncolors - 1);
+	pageinfo *pi = mem_alloc_color(color);
+	if (pi == NULL)
+		pi = mem_alloc();
+	assert(pi != 0);	// shouldn't be out of memory just yet!
+
+	cpu *c = (cpu*) mem_pi2ptr(pi);
+
+	// Clear the whole page for good measure: cpu struct and kernel stack
+	memset(c, 0, PAGESIZE);
+
+	// Now we need to initialize the new cpu struct
+	// just to the extent that's required for cpu_init() to work.
+	// Basically we just need to copy the GDT template from cpu_boot,
+	// and set the magic word.
+	memmove(c->gdt, cpu_boot.gdt, sizeof(c->gdt));
+	c->magic = CPU_MAGIC;
+
+	// Give it its own zero-filled copy of the per-CPU variables,
+	// pointing back to it.
+	assert(__stop_percpu - __start_percpu <= PAGESIZE);
+	pageinfo *ppi = mem_alloc_zeroed();
+	assert(ppi != NULL);
+	c->percpu = mem_pi2ptr(ppi);
+	*percpu_of(c, cpu_self) = c;
+
+	// Append the new cpu struct to the cpu list.
+	*cpu_tail = c;
+	cpu_tail = &c->next;
+
+	return c;
+}
+
+void
+cpu_bootothers(void)
+{
+	extern uint8_t _binary_obj_boot_bootother_start[],
+			_binary_obj_boot_bootother_size[];
+
+	if (!cpu_onboot()) {
+		// Just inform the boot cpu we've booted.
+		xchg(&cpu_cur()->booted, 1);
+		return;
+	}
+	cpu_boot.booted = 1;
+	if (cpu_boot.next == NULL || lapic == NULL)
+		return;		// nobody else to start
+
+	// Write bootstrap code to the page mem_init() reserved at 0x1000.
+	uint8_t *code = (uint8_t*)0x1000;
+	memmove(code, _binary_obj_boot_bootother_start,
+		(uint32_t)_binary_obj_boot_bootother_size);
+
+	cpu *c;
+	for(c = &cpu_boot; c; c = c->next){
+		if(c == cpu_cur())  // We've started already.
+			continue;
+
+		// Fill in %esp, %eip and start code on cpu.
+		*(void**)(code-4) = c->kstackhi;
+		*(void**)(code-8) = init;
+		lapic_startcpu(c->id, (uint32_t)code);
+
+		// Wait for cpu to get through bootstrap.
+		while(c->booted == 0)
+			pause();
+	}
+}
+
 
@@ -21,7 +21,8 @@
 #define CPU_GDT_UDATA	0x20	// user data
 #define CPU_GDT_UDTLS	0x28	// user thread local storage data segment
 #define CPU_GDT_TSS	0x30	// task state segment
-#define CPU_GDT_NDESC	7	// number of GDT entries used, including null
+#define CPU_GDT_KPERCPU	0x38	// kernel per-CPU data segment, for %gs
+#define CPU_GDT_NDESC	8	// number of GDT entries used, including null
 
 
 #ifndef __ASSEMBLER__
@@ -32,6 +33,30 @@
 #include <inc/mmu.h>
 #include <inc/trap.h>
 
+#include <kern/spinlock.h>
+#include <kern/mem.h>
+
+
+// Number of free pages each CPU can cache privately (see kern/mem.c).
+#define CPU_MAGSIZE	32
+
+// Number of kmalloc() size classes, and the number of free objects
+// of each class that each CPU can cache privately (see kern/mem.c).
+#define CPU_KMCLASSES	6
+#define CPU_KMCACHE	8
+
+// Number of separate address ranges a CPU's queue of pending
+// TLB shootdowns can hold before it degrades to a full flush.
+#define CPU_TLBRANGES	4
+
+// Number of MCS locks a CPU can hold or wait for at once (see spinlock.h).
+#define CPU_MCSNEST	4
+
+// Number of kpar_for() tasks each CPU's deque can hold (see kern/kpar.c).
+// Tasks are halved as they're pushed, so this bounds the nesting depth.
+#define CPU_KPARDEQ	32
+
+struct proc;
 
 // Per-CPU kernel state structure.
 // Exactly one page (4096 bytes) in size.
@@ -48,6 +73,44 @@ typedef struct cpu {
 	// for the higher privilege level from this task state structure.
 	taskstate	tss;
 
+	// Next in the list of all CPUs, starting with cpu_boot.
+	struct cpu	*next;
+
+	// Local APIC ID, for sending this CPU inter-processor interrupts.
+	uint8_t		id;
+
+	// This CPU's copy of the percpu section (see PERCPU below).
+	char		*percpu;
+
+	// Set once this CPU has gotten through init() to cpu_bootothers().
+	volatile uint32_t booted;
+
+	// The page directory this CPU has loaded (see pmap_switch()),
+	// so that CPUs changing its mappings know whose TLB to shoot down.
+	uint32_t	*pdir;
+
+	// TLB invalidations other CPUs have queued for this one
+	// (see pmap_shootdown()), merged into up to CPU_TLBRANGES
+	// ranges [tlblo, tlbhi), or if tlball, one CR3 reload instead.
+	// tlbreq counts requests queued, tlbdone the ones carried out.
+	spinlock	tlblock;
+	int		tlbn;
+	bool		tlball;
+	uint32_t	tlblo[CPU_TLBRANGES];
+	uint32_t	tlbhi[CPU_TLBRANGES];
+	volatile uint32_t tlbreq;
+	volatile uint32_t tlbdone;
+
+	// Queue of processes waiting to run on this CPU (see kern/proc.c),
+	// and the process it's running, if any.
+	// Other CPUs look at rqlen without the lock to find busy CPUs.
+	spinlock	rqlock;
+	struct proc	*rqhead;
+	struct proc	*rqtail;
+	volatile int	rqlen;
+	struct proc	*proc;
+	uint32_t	ticks;		// Timer interrupts so far
+
 	// When non-NULL, all traps get diverted to this handler.
 	gcc_noreturn void (*recover)(trapframe *tf, void *recoverdata);
 	void		*recoverdata;
@@ -79,15 +142,38 @@ extern cpu cpu_boot;
 
 #define cpu_disabled(c)		0
 
-// Find the CPU struct representing the current CPU.
-// It always resides at the bottom of the page containing the CPU's stack.
+// Per-CPU variables.
+// Declaring a global variable PERCPU puts it in the kernel's percpu section,
+// of which cpu_alloc() gives each additional CPU a zero-filled copy:
+// by then the boot CPU's copy holds its live state, not initial values.
+// Each CPU's %gs segment is based so that %gs:&var addresses its own copy
+// of var; the boot CPU's copy is the original, so its %gs base is zero.
+// Each variable gets its own cache line, as does each CPU's copy.
+#define PERCPU	gcc_aligned(MEM_CACHELINE) __attribute__((section("percpu")))
+
+// The linker defines these around the percpu section.
+extern char __start_percpu[], __stop_percpu[];
+
+// This CPU's cpu struct.
+extern PERCPU cpu *cpu_self;
+
+// Find the CPU struct representing the current CPU,
+// with a single load through the per-CPU segment.
 static inline cpu *
 cpu_cur() {
-	cpu *c = (cpu*)ROUNDDOWN(read_esp(), PAGESIZE);
-	assert(c->magic == CPU_MAGIC);
+	cpu *c;
+	asm("movl %%gs:%1,%0" : "=r" (c) : "m" (cpu_self));
 	return c;
 }
 
+// Return a pointer to CPU c's copy of per-CPU variable 'var',
+// for looking at another CPU's state, e.g., to steal work or total statistics.
+#define percpu_of(c, var)	\
+	((typeof(&(var))) ((c)->percpu + ((char*)&(var) - __start_percpu)))
+
+// Return a pointer to this CPU's copy of per-CPU variable 'var'.
+#define percpu_ptr(var)		percpu_of(cpu_cur(), var)
+
 // Returns true if we're running on the bootstrap CPU.
 static inline int
 cpu_onboot() {
@@ -95,9 +181,11 @@ cpu_onboot() {
 }
 
 
-// Set up the current CPU's private register state such as GDT and TSS.
+// Set up the current CPU's private register state such as GDT and TSS,
+// and point %gs at its per-CPU data.
 // Assumes the cpu struct for this CPU is basically initialized
-// and that we're running on the cpu's correct kernel stack.
+// and that we're running on the cpu's correct kernel stack,
+// which is how it finds the cpu struct: cpu_cur() doesn't work yet.
 void cpu_init(void);
 
 // Allocate an additional cpu struct representing a non-bootstrap processor,
@@ -17,13 +17,18 @@
 #include <kern/cons.h>
 #include <kern/debug.h>
 #include <kern/mem.h>
+#include <kern/membench.h>
+#include <kern/pmap.h>
 #include <kern/cpu.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
+#include <kern/mp.h>
+#include <kern/kpar.h>
+#include <kern/proc.h>
 
+#include <dev/lapic.h>
 
 
-// User-mode stack for user(), below, to run on.
-static char gcc_aligned(16) user_stack[PAGESIZE];
 
 #define ROOTEXE_START _binary_obj_user_sh_start
 
@@ -43,7 +48,11 @@ init(void)
 	// can not find start  --> in entry.S
 	// edata, end, --> 
 	extern char start[], edata[], end[];
-	
+
+	// Load this CPU's GDT and per-CPU segment first of all,
+	// since cpu_cur() and hence cpu_onboot() depend on %gs.
+	cpu_init();
+
 	// Before anything else, complete the ELF loading process.
 	// Clear all uninitialized global data (BSS) in our program,
 	// ensuring that all static/global variables start out zero.
@@ -57,72 +66,56 @@ init(void)
 	cons_init();
 
 	// Lab 1: test cprintf and debug_trace
-	cprintf("1234 decimal is %o octal!\n", 1234);
-	debug_check();	
-	// Initialize and load the bootstrap CPU's GDT, TSS, and IDT.
-	
-	cpu_init();
+	if (cpu_onboot()) {
+		cprintf("1234 decimal is %o octal!\n", 1234);
+		debug_check();
+	}
+	// Initialize and load the IDT.
 	trap_init();
-	// hong:
-	//cprintf("sizeof suer_stack : %x\n",sizeof(user_stack)); ->4096
-	//cprintf("&user_stack[0] : %x\n",&user_stack[0]); -> 0x1055c0
-	//cprintf("&user_stack[0] : %x\n",&user_stack[1]); -> 0x1055c1
-	//cprintf("&user_stack[4095]: %x\n",&user_stack[4096]); -> 0x1065c0
-	//panic("ssssss");
-	
+	if (cpu_onboot())
+		spinlock_check();
 	// Physical memory detection/initialization.
 	// Can't call mem_alloc until after we do this!
 	mem_init();
 	cprintf("out mem_init\n");
 
+	// Turn on paging with the kernel's page directory.
+	pmap_init();
+	if (cpu_onboot()) {
+		pmap_check();
+		mem_stats();
+		pmap_stats();
+	}
+
+	// Find and start the other processors, which come through here too.
+	mp_init();
+	lapic_init();
+	cpu_bootothers();
+
+#ifdef MEMBENCH
+	// Benchmark the memory allocator ("make DEFS=-DMEMBENCH"),
+	// on all CPUs at once.
+	membench();
+#endif
 
-	// Lab 1: change this so it enters user() in user mode,
-	// running on the user_stack declared above,
-	// instead of just calling user() directly.
-	/*
-	static trapframe tf = {
-		fs: CPU_GDT_UDATA,
-		gs: CPU_GDT_UDATA,
-		es: CPU_GDT_UDATA,
-		ds: CPU_GDT_UDATA,
-		eip: (uintptr_t)(user),
-		cs: CPU_GDT_UCODE,
-		eflags: FL_IOPL_3,
-		esp:(uintptr_t)(&user_stack[sizeof(user_stack)]),
-		ss: CPU_GDT_UDATA,
-	};*/
-	 trapframe tf = {
-		gs: CPU_GDT_UDATA | 3,
-		fs: CPU_GDT_UDATA | 3,
-		es: CPU_GDT_UDATA | 3,
-		ds: CPU_GDT_UDATA | 3,
-		cs: CPU_GDT_UCODE | 3,
-		ss: CPU_GDT_UDATA | 3,
-		eflags: FL_IOPL_3,
-		eip: (uint32_t)user,
-		esp: (uint32_t)&user_stack[PAGESIZE],
-	};
-	trap_return(&tf);
-	user();
-	cprintf("out user\n");
-}
-
-// This is the first function that gets run in user mode (ring 3).
-// It acts as PIOS's "root process",
-// of which all other processes are descendants.
-void
-user()
-{
-	cprintf("in user()\n");
-	assert(read_esp() > (uint32_t) &user_stack[0]);
-	// hong:
-	// sizeof(user_stack) == 4096
-	assert(read_esp() < (uint32_t) &user_stack[sizeof(user_stack)]);
-
-	// Check that we're in user mode and can handle traps from there.
-	trap_check_user();
-
-	done();
+	// Try out parallel loops, with the other CPUs helping
+	// from their idle loops in proc_sched().
+	if (cpu_onboot()) {
+		kpar_check();
+		kpar_stats();
+	}
+
+	// Start processes to check traps from user mode and scheduling,
+	// watched from the kernel.  proc_check() calls done() when it's done.
+	if (cpu_onboot()) {
+		trap_check_user();
+		proc_check();
+	}
+
+	// From here on every CPU just runs processes as they come along,
+	// taking timer interrupts to share itself among them.
+	proc_init();
+	proc_sched();
 }
 
 // This is a function that we call when the kernel is "done" -
@@ -20,9 +20,6 @@
 // Called on each processor to initialize the kernel.
 void init(void);
 
-// First function run in user mode (only on one processor)
-void user(void);
-
 // Called when there is no more work left to do in the system.
 // The grading scripts trap calls to this to know when to stop.
 void done(void) gcc_noreturn;
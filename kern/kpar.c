@@ -0,0 +1,303 @@
+/*
+ * Parallel loops over the kernel's CPUs, using work stealing.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
+#include <kern/kpar.h>
+
+#include <dev/lapic.h>
+
+
+// One kpar_for() call in progress, on its caller's stack.
+// Only the caller frees it, by returning once 'pending' reaches zero,
+// so no task may touch it after subtracting its share from 'pending'.
+typedef struct kparjob {
+	kparfn		*fn;
+	void		*arg;
+	uint32_t	grain;
+	volatile int32_t pending;	// Indexes not yet done
+} kparjob;
+
+// A piece of a job's range, as it sits in a CPU's deque.
+typedef struct kpartask {
+	kparjob		*job;
+	uint32_t	lo, hi;
+} kpartask;
+
+// Each CPU's deque of tasks waiting to run, and its statistics.
+// The CPU pushes and pops tasks at the bottom without locking,
+// while other CPUs steal them from the top with cmpxchg.
+typedef struct kparcpu {
+	volatile int32_t top;
+	volatile int32_t bot;
+	kpartask	deq[CPU_KPARDEQ];
+
+	uint32_t	tasks;		// tasks this CPU ran
+	uint32_t	steals;		// ...that it stole from other CPUs
+	uint32_t	misses;		// steal attempts that lost a race
+	uint64_t	idle;		// cycles it spent waiting in a join
+} kparcpu;
+static PERCPU kparcpu kpar_cpu;
+
+#define KPAR_SLOT(i)	((i) & (CPU_KPARDEQ - 1))
+
+
+// The deques are Chase and Lev's, minus the resizing:
+// the owning CPU alone moves bot, and everyone, including the owner
+// when it takes the last task, claims tasks at top with cmpxchg.
+// A thief may read a slot the owner is overwriting,
+// but only once the task that was there is gone from the top,
+// in which case the thief's cmpxchg fails and it discards what it read.
+
+// Push a task onto the bottom of our deque, if there's room.
+static bool
+kpar_push(kparcpu *k, kparjob *job, uint32_t lo, uint32_t hi)
+{
+	int32_t b = k->bot;
+	if (b - k->top >= CPU_KPARDEQ)
+		return false;
+	k->deq[KPAR_SLOT(b)].job = job;
+	k->deq[KPAR_SLOT(b)].lo = lo;
+	k->deq[KPAR_SLOT(b)].hi = hi;
+
+	// x86 keeps stores in order, so thieves see the task before bot.
+	asm volatile("" : : : "memory");
+	k->bot = b + 1;
+	return true;
+}
+
+// Pop the most recently pushed task off the bottom of our deque,
+// if it belongs to 'job', or to any job if 'job' is NULL.
+static bool
+kpar_pop(kparcpu *k, kparjob *job, kpartask *t)
+{
+	// Only we write our slots, so we can look at the bottom one first.
+	int32_t b = k->bot - 1;
+	if (job != NULL && b >= k->top
+			&& k->deq[KPAR_SLOT(b)].job != job)
+		return false;
+	k->bot = b;
+
+	// Make sure thieves see the smaller bot before we look at top,
+	// so that we and a thief can't both take the same task.
+	mfence();
+	int32_t top = k->top;
+	if (top > b) {		// deque was empty
+		k->bot = top;
+		return false;
+	}
+	t->job = k->deq[KPAR_SLOT(b)].job;
+	t->lo = k->deq[KPAR_SLOT(b)].lo;
+	t->hi = k->deq[KPAR_SLOT(b)].hi;
+	if (top < b)
+		return true;
+
+	// That was the last task, so race any thieves for it.
+	bool won = cmpxchg((volatile uint32_t*)&k->top, top, top + 1)
+			== (uint32_t) top;
+	k->bot = top + 1;
+	return won;
+}
+
+// Steal the oldest, and hence largest, task from the top of v's deque,
+// if it belongs to 'job', or to any job if 'job' is NULL.
+static bool
+kpar_steal(kparcpu *k, kparcpu *v, kparjob *job, kpartask *t)
+{
+	int32_t top = v->top;
+	int32_t b = v->bot;
+	if (top >= b)
+		return false;
+	asm volatile("" : : : "memory");
+	t->job = v->deq[KPAR_SLOT(top)].job;
+	t->lo = v->deq[KPAR_SLOT(top)].lo;
+	t->hi = v->deq[KPAR_SLOT(top)].hi;
+	if (job != NULL && t->job != job)
+		return false;
+	if (cmpxchg((volatile uint32_t*)&v->top, top, top + 1)
+			!= (uint32_t) top) {
+		k->misses++;
+		return false;
+	}
+	k->steals++;
+	return true;
+}
+
+// Run a task, first splitting off the upper halves of its range
+// for ourselves or other CPUs to pick up later.
+static void
+kpar_run(kparcpu *k, kpartask *t)
+{
+	kparjob *job = t->job;
+	uint32_t lo = t->lo, hi = t->hi;
+
+	while (hi - lo > job->grain) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (!kpar_push(k, job, mid, hi))
+			break;		// deque's full: just do it all here
+		hi = mid;
+	}
+	job->fn(job->arg, lo, hi);
+	k->tasks++;
+	lockadd(&job->pending, -(int32_t) (hi - lo));
+}
+
+// Find a task of 'job', or of any job if 'job' is NULL,
+// on our own deque or else on another CPU's.
+static bool
+kpar_take(cpu *c, kparjob *job, kpartask *t)
+{
+	kparcpu *k = percpu_of(c, kpar_cpu);
+	if (kpar_pop(k, job, t))
+		return true;
+
+	// Try the other CPUs in turn, starting with the next one,
+	// so that the thieves don't all pile onto the same victim.
+	cpu *v = c;
+	while ((v = v->next ? v->next : &cpu_boot) != c)
+		if (kpar_steal(k, percpu_of(v, kpar_cpu), job, t))
+			return true;
+	return false;
+}
+
+bool
+kpar_work(void)
+{
+	cpu *c = cpu_cur();
+	kpartask t;
+
+	if (!kpar_take(c, NULL, &t))
+		return false;
+	kpar_run(percpu_of(c, kpar_cpu), &t);
+	return true;
+}
+
+void
+kpar_for(uint32_t lo, uint32_t hi, uint32_t grain, kparfn *fn, void *arg)
+{
+	cpu *c = cpu_cur();
+	kparcpu *k = percpu_of(c, kpar_cpu);
+
+	if (hi <= lo)
+		return;
+	assert(hi - lo <= 0x7fffffff);
+	if (grain == 0)
+		grain = 1;
+	if (hi - lo <= grain) {		// not worth the trouble
+		fn(arg, lo, hi);
+		k->tasks++;
+		return;
+	}
+
+	kparjob job = { fn, arg, grain, hi - lo };
+	kpartask t = { &job, lo, hi };
+
+	// Get any sleeping CPUs out of hlt to come and steal,
+	// then start in on the work ourselves.
+	cpu *v;
+	if (lapic != NULL)
+		for (v = &cpu_boot; v != NULL; v = v->next)
+			if (v != c && v->booted)
+				lapic_ipi(v->id, T_WAKEUP);
+	kpar_run(k, &t);
+
+	// Join: keep running our job's tasks until all of them are done.
+	// Only ours, so the kernel stack nests no deeper than the loops do:
+	// an enclosing job's task could start yet another join on top of this.
+	// While there's nothing to do, carry out any TLB shootdowns queued
+	// for us, since the CPU sending them may be running one of our tasks.
+	while (job.pending != 0) {
+		assert(c->magic == CPU_MAGIC);	// stack overflow into struct cpu?
+		uint64_t t0 = rdtsc();
+		if (kpar_take(c, &job, &t)) {
+			kpar_run(k, &t);
+			continue;
+		}
+		if (c->tlbdone != c->tlbreq)
+			pmap_tlbdrain();
+		pause();
+		k->idle += rdtsc() - t0;
+	}
+}
+
+void
+kpar_stats(void)
+{
+	cprintf("kpar_stats: cpu    tasks  steals misses   idle cycles\n");
+	cpu *c;
+	int i;
+	for (c = &cpu_boot, i = 0; c != NULL; c = c->next, i++) {
+		kparcpu *k = percpu_of(c, kpar_cpu);
+		cprintf("kpar_stats: %3d %8d %7d %6d %13lld\n",
+			i, k->tasks, k->steals, k->misses, k->idle);
+	}
+}
+
+
+static void
+kpar_check_inc(void *arg, uint32_t lo, uint32_t hi)
+{
+	uint8_t *count = arg;
+	uint32_t i;
+
+	// Each index is in exactly one piece, so no atomic increment needed.
+	for (i = lo; i < hi; i++)
+		count[i]++;
+}
+
+static void
+kpar_check_nested(void *arg, uint32_t lo, uint32_t hi)
+{
+	uint32_t i;
+
+	for (i = lo; i < hi; i++)
+		kpar_for(i * 256, (i + 1) * 256, 16, kpar_check_inc, arg);
+}
+
+void
+kpar_check(void)
+{
+	pageinfo *pi = mem_alloc();
+	assert(pi != NULL);
+	uint8_t *count = mem_pi2ptr(pi);
+	int i;
+
+	// Empty ranges do nothing, and a zero grain means one.
+	memset(count, 0, PAGESIZE);
+	kpar_for(5, 5, 1, kpar_check_inc, count);
+	kpar_for(7, 3, 1, kpar_check_inc, count);
+	kpar_for(0, 100, 0, kpar_check_inc, count);
+	for (i = 0; i < PAGESIZE; i++)
+		assert(count[i] == (i < 100));
+
+	// Every index gets done exactly once, at various grain sizes.
+	memset(count, 0, PAGESIZE);
+	kpar_for(0, PAGESIZE, 1, kpar_check_inc, count);
+	kpar_for(0, PAGESIZE, 37, kpar_check_inc, count);
+	kpar_for(1, PAGESIZE - 1, PAGESIZE, kpar_check_inc, count);
+	for (i = 0; i < PAGESIZE; i++)
+		assert(count[i] == 3 - (i == 0 || i == PAGESIZE - 1));
+
+	// Tasks can start parallel loops of their own.
+	memset(count, 0, PAGESIZE);
+	kpar_for(0, PAGESIZE / 256, 1, kpar_check_nested, count);
+	for (i = 0; i < PAGESIZE; i++)
+		assert(count[i] == 1);
+
+	// Our deque is empty again.
+	kparcpu *k = percpu_ptr(kpar_cpu);
+	assert(k->top == k->bot);
+
+	mem_free(pi);
+	cprintf("kpar_check() succeeded!\n");
+}
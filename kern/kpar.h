@@ -0,0 +1,39 @@
+/*
+ * Parallel loops over the kernel's CPUs, using work stealing.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_KPAR_H
+#define PIOS_KERN_KPAR_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// Function to run on the index range [lo, hi) of a parallel loop.
+typedef void kparfn(void *arg, uint32_t lo, uint32_t hi);
+
+// Call fn(arg, lo', hi') on pieces covering [lo, hi), in parallel,
+// and return once all of them have finished.
+// The range is split in halves until the pieces are at most 'grain' long;
+// each CPU works on its own pieces and steals others' when it runs out.
+// fn may run on any CPU with interrupts disabled, and may call kpar_for()
+// itself, though not too deeply: kernel stacks are small.
+void kpar_for(uint32_t lo, uint32_t hi, uint32_t grain, kparfn *fn, void *arg);
+
+// Run or steal one waiting kpar_for() task, if there is one.
+// Idle CPUs call this to help out; kpar_for() wakes them when it starts.
+// Returns true if it found something to do.
+bool kpar_work(void);
+
+// Print each CPU's kpar_for() task, steal, and idle time counts,
+// for tuning the grain sizes callers use.
+void kpar_stats(void);
+
+// Check kpar_for() on whatever CPUs are running.
+void kpar_check(void);
+
+#endif /* !PIOS_KERN_KPAR_H */
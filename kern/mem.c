@@ -12,11 +12,16 @@
 #include <inc/mmu.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/vm.h>
 
 #include <kern/cpu.h>
 #include <kern/mem.h>
+#include <kern/spinlock.h>
+
+#include <kern/multiboot.h>
 
 #include <dev/nvram.h>
+#include <dev/e820.h>
 
 
 size_t mem_max;			// Maximum physical address
@@ -24,26 +29,298 @@ size_t mem_npage;		// Total number of physical memory pages
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
 
-pageinfo *mem_freelist;		// Start of free page list
+pageinfo *mem_freelist[MEM_NORDER];	// Buddy free lists, one per order
+size_t mem_nfree[MEM_NORDER];		// Number of blocks on each list
+mcslock mem_buddylock;			// Protects the buddy free lists
+
+// Fields of pageinfo.link besides the flags, for free pages on lists.
+#define MEM_PI_NEXT	0x000fffff	// Index of the next page on the list
+#define MEM_PI_ORDERSHIFT 20		// Order of a buddy block, in bits 20-23
+#define MEM_PI_ORDERMASK 0xf
+
+// What mem_order() returns for any page that is not the head
+// of a block on one of the buddy allocator's free lists.
+#define MEM_NOTFREE	(-1)
+
+// There is no room in a pageinfo for the back links that let us take
+// a block off the middle of a buddy free list, so a block that isn't first
+// on its list keeps the index of the block before it in its first word.
+// Nothing else uses the memory while it's free, and the first block
+// on each list doesn't need one, so popping a block never touches the next.
+#define mem_backlink(pi)	(*(uint32_t*) mem_pi2ptr(pi))
+
+// Bitmap with one bit per page, set if the page is in some block
+// on the buddy free lists, so we can scan for runs of free pages
+// without touching their pageinfo structs.
+// Two summary bitmaps have one bit per 32-page word of mem_freemap:
+// in mem_anymap it's set if any page in the word is free,
+// and in mem_fullmap, if all of them are,
+// so scans can skip 1024 pages at a time of either.
+// Like the free lists, these are protected by mem_buddylock.
+static uint32_t *mem_freemap;
+static uint32_t *mem_anymap;
+static uint32_t *mem_fullmap;
+static uint32_t mem_nbitwords;		// Number of words in mem_freemap
+static uint32_t mem_nsumwords;		// ...and in each summary bitmap
+
+int mem_ncolors = 1;			// Page colors in the largest cache
+static int mem_colororder;		// log2(mem_ncolors)
+static pageinfo *mem_colorlist[MEM_MAXCOLORS];	// Free pages by color
+static int mem_colornfree;		// Pages on all the color lists
+static spinlock mem_colorlock;		// Protects mem_colorlist
+
+// Lock-free LIFO stack of pages linked through pageinfo.link.
+// In the lock-free version, the top-of-stack pointer is paired with a
+// generation count that changes on every update, and the two are
+// replaced together with cmpxchg8b: otherwise a CPU could pop a page,
+// another pop and push it back, and the first CPU's compare-and-swap
+// would succeed with a stale next pointer (the "ABA" problem).
+typedef union memtop {
+	struct {
+		pageinfo	*top;	// First page on the stack
+		uint32_t	gen;	// Generation count
+	} s;
+	uint64_t	word;		// Both of the above, for cmpxchg8b
+} memtop;
+
+typedef struct memstack {
+	volatile memtop	head;
+	volatile int32_t npages;	// Pages on the stack, roughly
+#if !MEM_LOCKFREE
+	spinlock	lock;		// Protects head
+#endif
+} memstack;
+
+// Global depot of free single pages sitting between the per-CPU magazines
+// and the buddy allocator, so that magazine refills and spills
+// usually don't need to take mem_buddylock at all.
+static memstack mem_depot;
+
+// Pool of free pages that have already been zeroed,
+// filled in the background by mem_idle() and drained by mem_alloc_zeroed().
+static memstack mem_zeropool;
+#define MEM_ZEROMAX	256	// Stop zeroing when the pool is this full
+#define MEM_ZEROBATCH	8	// Pages to zero per call to mem_idle()
+
+// Beyond this many pages in the depot, spills go straight to the buddy
+// allocator instead, so the free pages get a chance to coalesce.
+#define MEM_DEPOTMAX	1024
+
+// Number of pages moved between a CPU's magazine and the depot
+// or buddy allocator at once, preferably as one block of order MEM_MAGORDER.
+// Keeping this at half the magazine size means a CPU that alternates
+// allocs and frees around a refill or spill won't immediately bounce back.
+#define MEM_MAGBATCH	(CPU_MAGSIZE/2)
+#define MEM_MAGORDER	4		// log2(MEM_MAGBATCH)
+
+// Magazine of free pages private to each CPU, sitting in front of
+// the depot and the buddy allocator so that most mem_alloc()/mem_free()
+// calls touch no shared cache lines.  mag[magcnt-1] is the hottest page.
+// The statistics count how often allocs and frees stay on the CPU.
+// Only the CPU itself updates its copy, so they need no atomic instructions;
+// mem_stats() reads and totals them for all CPUs.
+typedef struct memcpu {
+	pageinfo	*mag[CPU_MAGSIZE];
+	int		magcnt;
+
+	uint32_t	mag_allocs;	// calls to mem_alloc()
+	uint32_t	mag_allochits;	// ...satisfied without a refill
+	uint32_t	mag_frees;	// calls to mem_free()
+	uint32_t	mag_freehits;	// ...absorbed without a spill
+	uint32_t	mag_refills;	// batch transfers from the depot or buddies
+	uint32_t	mag_spills;	// batch transfers back to them
+	uint32_t	mem_fails;	// allocs that found no free memory
+	uint32_t	batch_allocs;	// pages allocated by mem_alloc_batch()
+	uint32_t	batch_frees;	// pages freed by mem_free_batch()
+
+	uint32_t	zero_hits;	// zeroed allocs served from the pool
+	uint32_t	zero_misses;	// ...that had to zero synchronously
+	uint32_t	zero_filled;	// pages this CPU zeroed while idle
+} memcpu;
+static PERCPU memcpu mem_cpu;
 
-//pageinfo tmp_paginfo[1024*1024*1024/PAGESIZE];
-pageinfo tmp_mem_pageinfo[1024*1024*1024/PAGESIZE];
+// Usable physical memory, as page-aligned [start,end) address ranges.
+// Firmware-reserved areas have already been carved out of these.
+#define MEM_MAXRANGES	32
+typedef struct memrange {
+	uint32_t	start;
+	uint32_t	end;
+} memrange;
+static memrange mem_ranges[MEM_MAXRANGES];
+static int mem_nranges;
+
+// We can only manage pages the kernel can reach through its mapping
+// of physical memory, which ends where the user address space begins:
+// the first 1GB of RAM, not the 4GB a 32-bit physical address could reach.
+#define MEM_TOP		((uint64_t) VM_USERLO)
+
+// mem_init() only sets up the pageinfo entries for the first few chunks of
+// physical memory, leaving the rest to be initialized as they're needed.
+// A chunk is the size of the largest buddy block and naturally aligned,
+// so a block's buddy is always in the same chunk:
+// the buddy allocator never looks at a pageinfo entry we haven't set up.
+#define MEM_CHUNKPAGES	(1 << MEM_MAXORDER)
+#define MEM_EAGERCHUNKS	4	// Chunks to initialize past the reserved ones
+static uint32_t mem_nchunks;		// Total chunks of physical memory
+static uint32_t mem_lazynext;		// First chunk not yet initialized
+static size_t mem_lazypages;		// Usable pages in those chunks
+static size_t mem_navail;		// Usable pages, initialized or not
+static uint32_t mem_reserved_end;	// End of kernel and pageinfo array
+
+// The slab allocator behind kmalloc() carves single pages into objects.
+// Each slab starts with this header, taking up the first cache line,
+// followed by equal-sized objects threaded onto an embedded free list.
+// Since slabs are page-aligned, kfree() finds an object's slab
+// just by rounding the object's address down.
+typedef struct slab {
+	struct slab	*next;		// Next slab on class's partial list
+	struct slab	**prev;		// Link pointing to us on that list
+	struct kmclass	*cls;		// Size class this slab belongs to
+	void		*free;		// First free object in this slab
+	int32_t		inuse;		// Objects allocated from this slab
+	uint32_t	magic;		// SLAB_MAGIC, to catch bogus kfree()s
+} slab;
+#define SLAB_MAGIC	0x51ab51ab
+#define SLAB_SPACE	(PAGESIZE - MEM_CACHELINE)	// Room for objects
+
+// Slabs and statistics for one kmalloc() size class.
+typedef struct kmclass {
+	spinlock	lock;		// Protects everything below
+	size_t		size;		// Size of each object
+	int		perslab;	// Objects per slab
+	slab		*partial;	// Slabs with some objects free
+	slab		*empty;		// One wholly free slab kept in reserve
+	int		color;		// Page color for this class's next slab
+	int		nslabs;		// Slabs currently allocated
+	int		nobjs;		// Objects out of slabs, incl. CPU caches
+	uint32_t	slaballocs;	// Slabs ever created
+	uint32_t	slabfrees;	// Slabs ever given back to mem_free()
+} kmclass;
+
+// The size classes are all multiples of the cache line size.
+// Besides the powers of two that fill a slab well, they are chosen to
+// divide a slab's space evenly: 576 and 1344 bytes fit 7 and 3 objects
+// with nothing left over, and KMALLOC_MAX is the most that fits two.
+static kmclass kmalloc_classes[CPU_KMCLASSES] = {
+	{ .size = 64 }, { .size = 128 }, { .size = 256 },
+	{ .size = 576 }, { .size = 1344 }, { .size = KMALLOC_MAX },
+};
+
+// Caches of free kmalloc() objects private to each CPU,
+// one per size class, working like the page magazines,
+// and statistics of how often allocs and frees stay on the CPU.
+typedef struct kmcache {
+	struct {
+		void	*obj[CPU_KMCACHE];
+		int	n;
+	} cache[CPU_KMCLASSES];
+
+	uint32_t	allocs;		// calls to kmalloc()
+	uint32_t	allochits;	// ...satisfied from the cache
+	uint32_t	frees;		// calls to kfree()
+	uint32_t	freehits;	// ...absorbed by the cache
+} kmcache;
+static PERCPU kmcache kmalloc_cache;
+
+// Number of objects moved between a CPU's kmcache and the slabs at once.
+#define KMALLOC_BATCH	(CPU_KMCACHE/2)
 
 
 void mem_check(void);
+static void mem_color_init(void);
+static void kmalloc_init(void);
+static void kmalloc_check(void);
+static void mem_buddy_free(pageinfo *pi, int order);
+static size_t mem_chunk_init(uint32_t chunk);
+static bool mem_lazy_expand(void);
+static void mem_stack_drain(memstack *st);
 
-void
-mem_init(void)
+
+// Return a page's index, to link it into a list, or 0 for the end of a list.
+static gcc_inline uint32_t
+mem_index(pageinfo *pi)
 {
-	extern char start[], edata[], end[];
-	cprintf("start : 0x%x, 0x%x\n",start, &start[0]);
-	cprintf("edata : 0x%x\n",edata);
-	cprintf("end : 0x%x, 0x%x\n",end, &end[0]);
-	cprintf("&mem_pageinfo : 0x%x\n",&mem_pageinfo);
-	cprintf("&mem_freelist : 0x%x\n",&mem_freelist);
-	cprintf("&tmp_paginfo : 0x%x\n",&tmp_mem_pageinfo);
-	if (!cpu_onboot())	// only do once, on the boot CPU
-		return;
+	return pi != NULL ? pi - mem_pageinfo : 0;
+}
+
+// Return the page after pi on whatever free list it's on, or NULL.
+static gcc_inline pageinfo *
+mem_next(pageinfo *pi)
+{
+	uint32_t idx = pi->link & MEM_PI_NEXT;
+	return idx != 0 ? &mem_pageinfo[idx] : NULL;
+}
+
+// Return the order of the free block headed by pi, or MEM_NOTFREE.
+static gcc_inline int
+mem_order(pageinfo *pi)
+{
+	uint32_t link = pi->link;
+	if (!(link & MEM_PI_BUDDY))
+		return MEM_NOTFREE;
+	return (link >> MEM_PI_ORDERSHIFT) & MEM_PI_ORDERMASK;
+}
+
+// Push a free page onto a private singly linked list of free pages.
+static void
+mem_page_push(pageinfo **list, pageinfo *pi)
+{
+	assert(pi->refcount == 0);
+	pi->link = MEM_PI_LINKED | mem_index(*list);
+	*list = pi;
+}
+
+// Pop the first page off such a list, leaving it with no references,
+// or return NULL if the list is empty.
+static pageinfo *
+mem_page_pop(pageinfo **list)
+{
+	pageinfo *pi = *list;
+	if (pi != NULL) {
+		*list = mem_next(pi);
+		pi->refcount = 0;
+	}
+	return pi;
+}
+
+// Find the physical memory map the firmware provides and copy it into 'map'.
+// In order of preference, we use:
+//  1) the memory map from a multiboot loader such as GRUB;
+//  2) the BIOS E820 map that boot/boot.S collected for us;
+//  3) the multiboot loader's or NVRAM's simple base/extended memory sizes,
+//     which know nothing about holes and top out at 64MB for the NVRAM.
+// Returns the number of entries.
+static int
+mem_detect(e820entry *map, int max)
+{
+	int n = 0;
+
+	multiboot_info *mbi = NULL;
+	if (multiboot_magic == MULTIBOOT_BOOTLOADER_MAGIC)
+		mbi = mem_ptr(multiboot_infoaddr);
+
+	if (mbi != NULL && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+		uint32_t p = mbi->mmap_addr;
+		uint32_t lim = p + mbi->mmap_length;
+		while (p < lim && n < max) {
+			multiboot_mmap *mm = mem_ptr(p);
+			map[n].addr = mm->addr;
+			map[n].len = mm->len;
+			map[n].type = mm->type;
+			n++;
+			p += mm->size + sizeof(mm->size);
+		}
+		cprintf("Physical memory map from multiboot loader:\n");
+		return n;
+	}
+
+	e820map *em = mem_ptr(E820_MAP);
+	if (mbi == NULL && em->nbytes >= E820_ENTSIZE) {
+		n = MIN((int) (em->nbytes / E820_ENTSIZE), max);
+		memmove(map, em->ent, n * sizeof(e820entry));
+		cprintf("Physical memory map from BIOS E820:\n");
+		return n;
+	}
 
 	// Determine how much base (<640K) and extended (>1MB) memory
 	// is available in the system (in bytes),
@@ -51,25 +328,122 @@ mem_init(void)
 	// The NVRAM tells us how many kilobytes there are.
 	// Since the count is 16 bits, this gives us up to 64MB of RAM;
 	// additional RAM beyond that would have to be detected another way.
-	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
-	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
-	cprintf("basemem : 0x%x\n",basemem);   // -> 0xa0000 == 640k 
-	cprintf("extmem : 0x%x\n",extmem);		// -> 0x3fff000 == 
-	warn("Assuming we have 1GB of memory!");
-	extmem = 1024*1024*1024 - MEM_EXT;	// assume 1GB total memory
+	size_t basemem, extmem;
+	if (mbi != NULL && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+		basemem = ROUNDDOWN(mbi->mem_lower*1024, PAGESIZE);
+		extmem = ROUNDDOWN(mbi->mem_upper*1024, PAGESIZE);
+	} else {
+		basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
+		extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
+	}
+	warn("No physical memory map; using base/extended memory sizes");
+	map[0] = (e820entry) { 0, basemem, E820_RAM };
+	map[1] = (e820entry) { MEM_EXT, extmem, E820_RAM };
+	return 2;
+}
 
-	// The maximum physical address is the top of extended memory.
-	mem_max = MEM_EXT + extmem;
+// Remove the page-aligned range [rs,re) from the usable memory ranges,
+// splitting a range in two if [rs,re) falls in the middle of it.
+static void
+mem_range_remove(uint32_t rs, uint32_t re)
+{
+	int i;
+	for (i = 0; i < mem_nranges; i++) {
+		memrange *r = &mem_ranges[i];
+		if (re <= r->start || rs >= r->end)
+			continue;		// no overlap
+		if (rs > r->start && re < r->end) {
+			// Keep both ends.  If we're out of space for ranges,
+			// we just lose the upper one: safe, if wasteful.
+			if (mem_nranges < MEM_MAXRANGES)
+				mem_ranges[mem_nranges++] =
+					(memrange) { re, r->end };
+			r->end = rs;
+		} else if (rs > r->start)
+			r->end = rs;		// keep the lower end
+		else if (re < r->end)
+			r->start = re;		// keep the upper end
+		else
+			r->end = r->start;	// nothing left
+	}
+}
+
+// Build mem_ranges from the firmware's memory map:
+// first collect all usable RAM, shrunk inward to whole pages,
+// then cut out anything that some other entry claims for other purposes,
+// since firmware maps are allowed to contain overlapping entries.
+static void
+mem_scan(e820entry *map, int n)
+{
+	uint64_t above = 0;
+	int i;
+
+	mem_nranges = 0;
+	for (i = 0; i < n; i++) {
+		uint64_t s = (map[i].addr + PAGESIZE-1) & ~(uint64_t) (PAGESIZE-1);
+		uint64_t e = (map[i].addr + map[i].len) & ~(uint64_t) (PAGESIZE-1);
+		cprintf("  [%08llx-%08llx) type %d\n", map[i].addr,
+			map[i].addr + map[i].len, map[i].type);
+		if (map[i].type != E820_RAM || mem_nranges == MEM_MAXRANGES)
+			continue;
+		if (e > MEM_TOP) {
+			above += e - MAX(s, MEM_TOP);
+			e = MEM_TOP;
+		}
+		if (s < e)
+			mem_ranges[mem_nranges++] = (memrange) { s, e };
+	}
+	if (above > 0)
+		cprintf("  ignoring 0x%xK of RAM above VM_USERLO\n",
+			(int) (above / 1024));
+	for (i = 0; i < n; i++) {
+		if (map[i].type == E820_RAM || map[i].addr >= MEM_TOP)
+			continue;
+		uint64_t s = map[i].addr & ~(uint64_t) (PAGESIZE-1);
+		uint64_t e = (map[i].addr + map[i].len + PAGESIZE-1)
+				& ~(uint64_t) (PAGESIZE-1);
+		mem_range_remove(s, MIN(e, MEM_TOP));
+	}
+}
+
+// Return true if all of [start,end) is usable RAM.
+static bool
+mem_range_usable(uint32_t start, uint32_t end)
+{
+	int i;
+	for (i = 0; i < mem_nranges; i++)
+		if (start >= mem_ranges[i].start && end <= mem_ranges[i].end)
+			return true;
+	return false;
+}
+
+void
+mem_init(void)
+{
+	extern char start[], edata[], end[];
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	// Find out which physical address ranges hold usable RAM.
+	e820entry map[MEM_MAXRANGES];
+	mem_scan(map, mem_detect(map, MEM_MAXRANGES));
+
+	// The maximum physical address is the top of the highest usable range;
+	// anything between the ranges is a hole we never hand out.
+	int i;
+	size_t avail = 0;
+	mem_max = 0;
+	for (i = 0; i < mem_nranges; i++) {
+		mem_max = MAX(mem_max, mem_ranges[i].end);
+		avail += mem_ranges[i].end - mem_ranges[i].start;
+	}
+	assert(mem_max > MEM_EXT);
 
 	// Compute the total number of physical pages (including I/O holes)
 	mem_npage = mem_max / PAGESIZE;
 	
-	cprintf("Physical memory: 0x%xK available, ", (int)(mem_max/1024));
-	cprintf("base = 0x%xK, extended = 0x%xK\n",
-		(int)(basemem/1024), (int)(extmem/1024));
-	
-	//panic("aaaa\n");
-	
+	cprintf("Physical memory: 0x%xK available, top = 0x%xK\n",
+		(int)(avail/1024), (int)(mem_max/1024));
 
 	// Insert code here to:
 	// (1)	allocate physical memory for the mem_pageinfo array,
@@ -92,44 +466,633 @@ mem_init(void)
 	//     Hint: the linker places the kernel (see start and end above),
 	//     but YOU decide where to place the pageinfo array.
 	// Change the code to reflect this.
-	pageinfo **freetail = &mem_freelist;
-	int i;
-	uint32_t page_start;
-	mem_pageinfo = tmp_mem_pageinfo;
-	memset(tmp_mem_pageinfo, 0, sizeof(pageinfo)*1024*1024*1024/PAGESIZE);
-	for (i = 0; i < mem_npage; i++) {
-		
-		// A free page has no references to it.
-		mem_pageinfo[i].refcount = 0;
-		
-		// search free page
-		// reserve page 0 and 1
-		if (i == 0 || i == 1) {
-			continue;
-		}
-		page_start = mem_pi2phys(mem_pageinfo + i);
-		
-		// ignore [MEM_IO, MEM_EXT)
-		if (page_start + PAGESIZE >= MEM_IO && page_start < MEM_EXT) {
-			continue;
-		}
-		
-		// ignore [kernel]  --> ([start,end))
-		if (page_start + PAGESIZE >= (uint32_t)start && page_start < (uint32_t)end) {
-			continue;
-		}
-		
-		// Add the page to the end of the free list.
-		*freetail = &mem_pageinfo[i];
-		freetail = &mem_pageinfo[i].free_next;
+	//
+	// The pageinfo array goes in the pages immediately after the kernel,
+	// sized for the memory we actually found rather than a fixed maximum.
+	// It lies beyond 'end', so init() doesn't clear it as part of the BSS;
+	// instead mem_chunk_init() sets up each entry just before its first use.
+	// The free page bitmap and its summaries follow right after that.
+	static_assert(sizeof(pageinfo) == 4);
+	static_assert(MEM_TOP / PAGESIZE <= MEM_PI_NEXT);
+	uint64_t t0 = rdtsc();
+	mem_pageinfo = (pageinfo*) ROUNDUP((uintptr_t) end, PAGESIZE);
+	mem_nbitwords = (mem_npage + 31) / 32;
+	mem_nsumwords = (mem_nbitwords + 31) / 32;
+	mem_freemap = (uint32_t*) &mem_pageinfo[mem_npage];
+	mem_anymap = mem_freemap + mem_nbitwords;
+	mem_fullmap = mem_anymap + mem_nsumwords;
+	void *pageinfo_end = ROUNDUP(mem_fullmap + mem_nsumwords, PAGESIZE);
+	cprintf("mem_pageinfo : 0x%x-0x%x\n", mem_pageinfo, pageinfo_end);
+	if (!mem_range_usable(mem_phys(mem_pageinfo), mem_phys(pageinfo_end)))
+		panic("no usable memory for pageinfo array");
+	memset(mem_freemap, 0, (char*)pageinfo_end - (char*)mem_freemap);
+	mem_reserved_end = mem_phys(pageinfo_end);
+
+	mcslock_init(&mem_buddylock);
+	spinlock_init(&mem_colorlock);
+	mem_color_init();
+	kmalloc_init();
+#if !MEM_LOCKFREE
+	spinlock_init(&mem_depot.lock);
+	spinlock_init(&mem_zeropool.lock);
+#endif
+
+	// Initialize the chunks holding the kernel and the pageinfo array,
+	// plus a few more to get going with, and leave the rest for later.
+	// Only pages within usable ranges can be free;
+	// all the others stay reserved forever.
+	mem_nchunks = (mem_npage + MEM_CHUNKPAGES-1) / MEM_CHUNKPAGES;
+	uint32_t neager = mem_nchunks;
+	if (MEM_LAZYINIT)
+		neager = MIN(neager, (mem_reserved_end / PAGESIZE - 1)
+				/ MEM_CHUNKPAGES + 1 + MEM_EAGERCHUNKS);
+	mem_navail = 0;
+	for (i = 0; i < neager; i++)
+		mem_navail += mem_chunk_init(i);
+	mem_lazynext = neager;
+
+	mem_lazypages = 0;
+	for (i = 0; i < mem_nranges; i++) {
+		uint32_t s = MAX(mem_ranges[i].start / PAGESIZE,
+				neager * MEM_CHUNKPAGES);
+		if (s < mem_ranges[i].end / PAGESIZE)
+			mem_lazypages += mem_ranges[i].end / PAGESIZE - s;
 	}
-	*freetail = NULL;	// null-terminate the freelist
+	mem_navail += mem_lazypages;
+
+	uint64_t t = rdtsc() - t0;
+	cprintf("mem_init: %lld cycles, %d of %d chunks initialized\n",
+		t, neager, mem_nchunks);
 
 	// ...and remove this when you're ready.
 	//panic("mem_init() not implemented");
 
 	// Check to make sure the page allocator seems to work correctly.
 	mem_check();
+	kmalloc_check();
+}
+
+// Set or clear the free bits for a naturally aligned block of pages,
+// keeping the summary bitmaps up to date.
+static void
+mem_bitmap_set(uint32_t idx, int order, bool free)
+{
+	uint32_t n = 1 << order;
+	uint32_t w = idx / 32, wend = (idx + n + 31) / 32;
+	uint32_t mask = n >= 32 ? ~0 : ((1 << n) - 1) << (idx % 32);
+
+	for (; w < wend; w++) {
+		if (free)
+			mem_freemap[w] |= mask;
+		else
+			mem_freemap[w] &= ~mask;
+
+		uint32_t sbit = 1 << (w % 32);
+		if (mem_freemap[w] != 0)
+			mem_anymap[w / 32] |= sbit;
+		else
+			mem_anymap[w / 32] &= ~sbit;
+		if (mem_freemap[w] == ~0)
+			mem_fullmap[w / 32] |= sbit;
+		else
+			mem_fullmap[w / 32] &= ~sbit;
+	}
+}
+
+// Find the first word of mem_freemap at or after word w
+// that has any free pages in it (if free is true)
+// or any non-free pages (if free is false).
+// Returns mem_nbitwords if there is no such word.
+static uint32_t
+mem_bitmap_nextword(uint32_t w, bool free)
+{
+	uint32_t s = w / 32;
+	if (s >= mem_nsumwords)
+		return mem_nbitwords;
+
+	uint32_t bits = (free ? mem_anymap[s] : ~mem_fullmap[s])
+			& (~0U << (w % 32));
+	while (bits == 0) {
+		if (++s >= mem_nsumwords)
+			return mem_nbitwords;
+		bits = free ? mem_anymap[s] : ~mem_fullmap[s];
+	}
+	return MIN(s * 32 + bsf(bits), mem_nbitwords);
+}
+
+// Find the first page at or after page idx that is free (if free is true)
+// or not free (if free is false).
+// Returns mem_npage if there is no such page.
+static uint32_t
+mem_bitmap_scan(uint32_t idx, bool free)
+{
+	uint32_t w = idx / 32;
+	if (w >= mem_nbitwords)
+		return mem_npage;
+
+	uint32_t bits = (free ? mem_freemap[w] : ~mem_freemap[w])
+			& (~0U << (idx % 32));
+	if (bits == 0) {
+		w = mem_bitmap_nextword(w + 1, free);
+		if (w >= mem_nbitwords)
+			return mem_npage;
+		bits = free ? mem_freemap[w] : ~mem_freemap[w];
+		assert(bits != 0);
+	}
+	return MIN(w * 32 + bsf(bits), mem_npage);
+}
+
+// First-fit search of the free page bitmap for an aligned run of free pages.
+// Alternately skips to the next free page at an aligned position
+// and to the end of the run of free pages starting there,
+// until a run is long enough; both steps skip over whole words at a time.
+// Returns the index of the first page of the run, or mem_npage if none.
+// The caller must hold mem_buddylock.
+static uint32_t
+mem_bitmap_find(uint32_t npages, uint32_t align)
+{
+	uint32_t idx = 0;
+
+	assert(npages > 0 && align > 0 && (align & (align - 1)) == 0);
+	while (true) {
+		idx = mem_bitmap_scan(ROUNDUP(idx, align), true);
+		if (idx >= mem_npage)
+			return mem_npage;
+		if (idx % align != 0)
+			continue;		// round up and try again
+		uint32_t runend = mem_bitmap_scan(idx, false);
+		if (runend - idx >= npages)
+			return idx;
+		idx = runend;
+	}
+}
+
+// Push a free block onto the buddy free list for its order.
+static void
+mem_list_insert(pageinfo *pi, int order)
+{
+	assert(pi->refcount == 0);
+	mem_bitmap_set(pi - mem_pageinfo, order, true);
+	pageinfo *next = mem_freelist[order];
+	pi->link = MEM_PI_BUDDY | order << MEM_PI_ORDERSHIFT | mem_index(next);
+	if (next != NULL)
+		mem_backlink(next) = pi - mem_pageinfo;
+	mem_freelist[order] = pi;
+	mem_nfree[order]++;
+}
+
+// Unlink a free block from whichever buddy free list it is on, in O(1).
+static void
+mem_list_remove(pageinfo *pi)
+{
+	int order = mem_order(pi);
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	pageinfo *next = mem_next(pi);
+	if (mem_freelist[order] == pi)
+		mem_freelist[order] = next;	// next needs no back link now
+	else {
+		pageinfo *prev = &mem_pageinfo[mem_backlink(pi)];
+		assert(mem_next(prev) == pi);
+		prev->link = (prev->link & ~MEM_PI_NEXT) | mem_index(next);
+		if (next != NULL)
+			mem_backlink(next) = mem_backlink(pi);
+	}
+	mem_nfree[order]--;
+	mem_bitmap_set(pi - mem_pageinfo, order, false);
+	pi->link = 0;
+}
+
+//
+// Allocate a naturally aligned block of 2^order pages.
+// We take the first block from the smallest non-empty free list
+// of at least the requested order,
+// then split it in halves, freeing the upper half each time,
+// until it is the size the caller asked for.
+// The caller must hold mem_buddylock.
+//
+static pageinfo *
+mem_buddy_alloc(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+
+	int k = order;
+	while (mem_freelist[k] == NULL)
+		if (++k > MEM_MAXORDER) {
+			// Bring in another chunk of memory and look again.
+			if (!mem_lazy_expand())
+				return NULL;
+			k = order;
+		}
+
+	pageinfo *pi = mem_freelist[k];
+	mem_list_remove(pi);
+	while (k > order) {
+		k--;
+		mem_list_insert(pi + (1 << k), k);
+	}
+	return pi;
+}
+
+//
+// Free a block of 2^order pages.
+// As long as the block's buddy (the other half of the next-larger block)
+// is itself wholly free, take the buddy off its list and merge the two.
+// Reserved pages are never free, so they never get coalesced.
+// The caller must hold mem_buddylock.
+//
+static void
+mem_buddy_free(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	assert(pi->refcount == 0);
+
+	uint32_t idx = pi - mem_pageinfo;
+	assert(idx % (1 << order) == 0);
+	assert(idx + (1 << order) <= mem_npage);
+
+	while (order < MEM_MAXORDER) {
+		uint32_t bidx = idx ^ (1 << order);
+		if (bidx + (1 << order) > mem_npage ||
+				mem_order(&mem_pageinfo[bidx]) != order)
+			break;
+		mem_list_remove(&mem_pageinfo[bidx]);
+		idx &= ~(1 << order);
+		order++;
+	}
+	mem_list_insert(&mem_pageinfo[idx], order);
+}
+
+// Return true if page i should start out free:
+// that is, if it's usable RAM not reserved for something else.
+static bool
+mem_page_avail(uint32_t i)
+{
+	uint32_t page_start = i * PAGESIZE;
+
+	// reserve page 0 and 1
+	if (i == 0 || i == 1)
+		return false;
+
+	// ignore [MEM_IO, MEM_EXT)
+	if (page_start + PAGESIZE >= MEM_IO && page_start < MEM_EXT)
+		return false;
+
+	// ignore [kernel]  --> ([start,end))
+	// and the pageinfo array right after it
+	if (page_start + PAGESIZE >= (uint32_t)start
+			&& page_start < mem_reserved_end)
+		return false;
+
+	return mem_range_usable(page_start, page_start + PAGESIZE);
+}
+
+// Set up the pageinfo entries for one chunk of physical memory
+// and give its available pages to the buddy allocator,
+// returning the number of pages freed.
+// The caller must hold mem_buddylock.
+static size_t
+mem_chunk_init(uint32_t chunk)
+{
+	uint32_t first = chunk * MEM_CHUNKPAGES;
+	uint32_t lim = MIN(first + MEM_CHUNKPAGES, mem_npage);
+	uint32_t i;
+	size_t nfree = 0;
+
+	// A free page has no references to it,
+	// and nothing is on a free list until we put it there below.
+	memset(&mem_pageinfo[first], 0, (lim - first) * sizeof(pageinfo));
+
+	// Most chunks are all usable RAM, and become a single free block.
+	if (lim - first == MEM_CHUNKPAGES && first * PAGESIZE >= mem_reserved_end
+			&& mem_range_usable(first * PAGESIZE, lim * PAGESIZE)) {
+		mem_list_insert(&mem_pageinfo[first], MEM_MAXORDER);
+		return MEM_CHUNKPAGES;
+	}
+
+	// Otherwise free the pages one at a time,
+	// letting the buddy allocator merge them as far as it can.
+	for (i = first; i < lim; i++)
+		if (mem_page_avail(i)) {
+			mem_buddy_free(&mem_pageinfo[i], 0);
+			nfree++;
+		}
+	return nfree;
+}
+
+// Initialize the next chunk of physical memory with any free pages in it.
+// Returns false if there are no uninitialized chunks with free pages left.
+// The caller must hold mem_buddylock.
+static bool
+mem_lazy_expand(void)
+{
+	while (mem_lazynext < mem_nchunks) {
+		size_t nfree = mem_chunk_init(mem_lazynext++);
+		assert(nfree <= mem_lazypages);
+		mem_lazypages -= nfree;
+		if (nfree > 0)
+			return true;
+	}
+	return false;
+}
+
+pageinfo *
+mem_alloc_order(int order)
+{
+	mcslock_acquire(&mem_buddylock);
+	pageinfo *pi = mem_buddy_alloc(order);
+	mcslock_release(&mem_buddylock);
+	return pi;
+}
+
+void
+mem_free_order(pageinfo *pi, int order)
+{
+	mcslock_acquire(&mem_buddylock);
+	mem_buddy_free(pi, order);
+	mcslock_release(&mem_buddylock);
+}
+
+// A large page is simply the biggest block the buddy allocator manages.
+// If there isn't one, single pages sitting in the depot
+// may be all that's keeping one from coalescing, so give them back and retry.
+pageinfo *
+mem_alloc_large(void)
+{
+	static_assert((PAGESIZE << MEM_MAXORDER) == PTSIZE);
+
+	pageinfo *pi = mem_alloc_order(MEM_MAXORDER);
+	if (pi == NULL) {
+		mem_stack_drain(&mem_depot);
+		pi = mem_alloc_order(MEM_MAXORDER);
+	}
+	return pi;
+}
+
+void
+mem_free_large(pageinfo *pi)
+{
+	mem_free_order(pi, MEM_MAXORDER);
+}
+
+// Take whatever part of the free block of 2^order pages at 'head'
+// lies within [start,end) off the buddy free lists,
+// by splitting the block in halves until each piece is wholly inside
+// (and claimed) or wholly outside (and put back on a free list).
+// The caller must have already removed the block from its free list.
+static void
+mem_buddy_carve(uint32_t head, int order, uint32_t start, uint32_t end)
+{
+	uint32_t bend = head + (1 << order);
+	if (bend <= start || head >= end) {
+		mem_list_insert(&mem_pageinfo[head], order);
+		return;
+	}
+	if (head >= start && bend <= end)
+		return;
+
+	order--;
+	mem_buddy_carve(head, order, start, end);
+	mem_buddy_carve(head + (1 << order), order, start, end);
+}
+
+// Take the free pages [idx,idx+npages) off the buddy free lists,
+// splitting any free blocks that straddle the ends of the range.
+// The caller must hold mem_buddylock.
+static void
+mem_buddy_claim(uint32_t idx, uint32_t npages)
+{
+	uint32_t end = idx + npages, i = idx;
+
+	while (i < end) {
+		// Find the free block containing page i.
+		uint32_t head;
+		int k;
+		for (k = 0; ; k++) {
+			assert(k <= MEM_MAXORDER);
+			head = i & ~((1 << k) - 1);
+			if (mem_order(&mem_pageinfo[head]) == k)
+				break;
+		}
+
+		mem_list_remove(&mem_pageinfo[head]);
+		mem_buddy_carve(head, k, idx, end);
+		i = head + (1 << k);
+	}
+}
+
+// Find the first free page of the given color in the bitmap,
+// or return mem_npage if there is none.
+// The caller must hold mem_buddylock.
+static uint32_t
+mem_bitmap_find_color(int color)
+{
+	uint32_t idx = 0;
+
+	while ((idx = mem_bitmap_scan(idx, true)) < mem_npage) {
+		idx += (color - idx) & (mem_ncolors - 1);
+		if (idx >= mem_npage)
+			break;
+		if (mem_freemap[idx / 32] & (1 << (idx % 32)))
+			return idx;
+	}
+	return mem_npage;
+}
+
+pageinfo *
+mem_find_free_range(int npages, int align)
+{
+	uint32_t idx;
+
+	mcslock_acquire(&mem_buddylock);
+	while ((idx = mem_bitmap_find(npages, align)) >= mem_npage &&
+			mem_lazy_expand())
+		;
+	mcslock_release(&mem_buddylock);
+	return idx < mem_npage ? &mem_pageinfo[idx] : NULL;
+}
+
+pageinfo *
+mem_alloc_range(int npages, int align)
+{
+	uint32_t idx;
+
+	mcslock_acquire(&mem_buddylock);
+	while ((idx = mem_bitmap_find(npages, align)) >= mem_npage &&
+			mem_lazy_expand())
+		;
+	if (idx < mem_npage)
+		mem_buddy_claim(idx, npages);
+	mcslock_release(&mem_buddylock);
+	return idx < mem_npage ? &mem_pageinfo[idx] : NULL;
+}
+
+void
+mem_free_range(pageinfo *pi, int npages)
+{
+	int i;
+
+	mcslock_acquire(&mem_buddylock);
+	for (i = 0; i < npages; i++)
+		mem_buddy_free(&pi[i], 0);
+	mcslock_release(&mem_buddylock);
+}
+
+// Pop up to 'max' pages off a stack into pis[], returning the count.
+// The whole batch comes off in one update of the top of the stack.
+// Walking the list before the cmpxchg8b is safe even while other CPUs
+// are changing it, because pageinfo structs never go away:
+// at worst we read stale links, and then the generation count won't match.
+// Only once the pages are ours do we clear their links,
+// leaving them with the zero reference count mem_alloc() promises.
+static int
+mem_stack_pop(memstack *st, pageinfo **pis, int max)
+{
+	memtop old, new;
+	int n, i;
+
+#if MEM_LOCKFREE
+	do {
+		old.word = st->head.word;
+		pageinfo *pi = old.s.top;
+		for (n = 0; pi != NULL && n < max; n++) {
+			pis[n] = pi;
+			pi = mem_next(pi);
+		}
+		if (n == 0)
+			return 0;
+		new.s.top = pi;
+		new.s.gen = old.s.gen + 1;
+	} while (cmpxchg8b(&st->head.word, old.word, new.word) != old.word);
+#else
+	spinlock_acquire(&st->lock);
+	pageinfo *pi = st->head.s.top;
+	for (n = 0; pi != NULL && n < max; n++) {
+		pis[n] = pi;
+		pi = mem_next(pi);
+	}
+	st->head.s.top = pi;
+	spinlock_release(&st->lock);
+	if (n == 0)
+		return 0;
+#endif
+	lockadd(&st->npages, -n);
+	for (i = 0; i < n; i++)
+		pis[i]->link = 0;
+	return n;
+}
+
+// Push the n pages in pis[] onto a stack.
+// We link them together privately first,
+// then splice the whole sublist on in one update.
+static void
+mem_stack_push(memstack *st, pageinfo **pis, int n)
+{
+	memtop old, new;
+	int i;
+
+	assert(n > 0);
+	for (i = 0; i < n-1; i++) {
+		assert(pis[i]->refcount == 0);
+		pis[i]->link = MEM_PI_LINKED | mem_index(pis[i+1]);
+	}
+	assert(pis[n-1]->refcount == 0);
+
+#if MEM_LOCKFREE
+	new.s.top = pis[0];
+	do {
+		old.word = st->head.word;
+		pis[n-1]->link = MEM_PI_LINKED | mem_index(old.s.top);
+		new.s.gen = old.s.gen + 1;
+	} while (cmpxchg8b(&st->head.word, old.word, new.word) != old.word);
+#else
+	spinlock_acquire(&st->lock);
+	pis[n-1]->link = MEM_PI_LINKED | mem_index(st->head.s.top);
+	st->head.s.top = pis[0];
+	spinlock_release(&st->lock);
+#endif
+	lockadd(&st->npages, n);
+}
+
+// Move every page on a stack back to the buddy allocator.
+static void
+mem_stack_drain(memstack *st)
+{
+	pageinfo *pis[MEM_MAGBATCH];
+	int n, i;
+
+	while ((n = mem_stack_pop(st, pis, MEM_MAGBATCH)) > 0) {
+		mcslock_acquire(&mem_buddylock);
+		for (i = 0; i < n; i++)
+			mem_buddy_free(pis[i], 0);
+		mcslock_release(&mem_buddylock);
+	}
+}
+
+// Refill an empty magazine with MEM_MAGBATCH pages,
+// from the depot if it has any, and otherwise from the buddy allocator,
+// dipping into the pool of pre-zeroed pages only when all else fails
+// and 'zeroed' permits it.
+// From the buddy allocator that is normally one contiguous MEM_MAGORDER
+// block carved into pages, but if memory is fragmented
+// we make do with whatever smaller blocks exist.
+// Returns the number of pages obtained (0 if there is no free memory).
+static int
+mem_mag_refill(memcpu *mc, bool zeroed)
+{
+	assert(mc->magcnt == 0);
+
+	int n = mem_stack_pop(&mem_depot, mc->mag, MEM_MAGBATCH);
+	if (n == 0) {
+		int order = MEM_MAGORDER, i;
+		mcslock_acquire(&mem_buddylock);
+		while (n < MEM_MAGBATCH && order >= 0) {
+			pageinfo *pi = NULL;
+			if ((1 << order) <= MEM_MAGBATCH - n)
+				pi = mem_buddy_alloc(order);
+			if (pi == NULL) {
+				order--;
+				continue;
+			}
+			// Stack the pages so the lowest-addressed one
+			// comes out first.
+			for (i = (1 << order) - 1; i >= 0; i--)
+				mc->mag[n++] = pi + i;
+		}
+		mcslock_release(&mem_buddylock);
+	}
+	if (n == 0 && zeroed)	// Last resort: pages someone took the time to zero
+		n = mem_stack_pop(&mem_zeropool, mc->mag, MEM_MAGBATCH);
+	mc->magcnt = n;
+
+	if (n > 0)
+		mc->mag_refills++;
+	return n;
+}
+
+// Move the 'count' coldest pages in a magazine to the depot,
+// or to the buddy allocator (which coalesces them where possible)
+// if the depot already holds plenty.
+static void
+mem_mag_spill(memcpu *mc, int count)
+{
+	int i;
+
+	assert(count >= 0 && count <= mc->magcnt);
+	if (count == 0)
+		return;
+
+	if (mem_depot.npages + count <= MEM_DEPOTMAX)
+		mem_stack_push(&mem_depot, mc->mag, count);
+	else {
+		mcslock_acquire(&mem_buddylock);
+		for (i = 0; i < count; i++)
+			mem_buddy_free(mc->mag[i], 0);
+		mcslock_release(&mem_buddylock);
+	}
+
+	mc->magcnt -= count;
+	memmove(&mc->mag[0], &mc->mag[count], mc->magcnt * sizeof(mc->mag[0]));
+	mc->mag_spills++;
 }
 
 //
@@ -141,33 +1104,656 @@ mem_init(void)
 //   - a pointer to the page's pageinfo struct if successful
 //   - NULL if no available physical pages.
 //
-// Hint: pi->refs should not be incremented 
-// Hint: be sure to use proper mutual exclusion for multiprocessor operation.
+// This is the order-0 fast path in front of mem_alloc_order().
+// Pages come from the current CPU's magazine whenever possible;
+// only when it runs dry do we go to the shared buddy allocator,
+// and then we grab a whole batch of pages at once.
 pageinfo *
 mem_alloc(void)
 {
-	// Fill this function in
-	// Fill this function in.
-	// hong: 
-	// how to handle multiprocessor operation, where is the lock
-	if (mem_freelist == NULL)
+	memcpu *mc = percpu_ptr(mem_cpu);
+
+	mc->mag_allocs++;
+	if (mc->magcnt > 0)
+		mc->mag_allochits++;
+	else if (mem_mag_refill(mc, true) == 0) {
+		mc->mem_fails++;
 		return NULL;
-	pageinfo *result = mem_freelist;
-	mem_freelist = mem_freelist->free_next;
-	return result;
+	}
+
+	return mc->mag[--mc->magcnt];
 }
 
 //
 // Return a page to the free list, given its pageinfo pointer.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
+// The page goes into the current CPU's magazine,
+// from which it will likely be reallocated while still hot in the cache.
+// If the magazine is full, we spill its coldest half to the buddy allocator.
+//
 void
 mem_free(pageinfo *pi)
 {
-	// Fill this function in.
 	assert(pi->refcount == 0);
-	pi->free_next = mem_freelist;
-	mem_freelist = pi;
+
+	memcpu *mc = percpu_ptr(mem_cpu);
+	mc->mag_frees++;
+	if (mc->magcnt < CPU_MAGSIZE)
+		mc->mag_freehits++;
+	else
+		mem_mag_spill(mc, MEM_MAGBATCH);
+
+	mc->mag[mc->magcnt++] = pi;
+}
+
+// Take up to 'n' pages from the buddy allocator into out[],
+// in blocks as large as possible, with one acquisition of mem_buddylock.
+// Returns the number of pages we got.
+static int
+mem_buddy_alloc_batch(pageinfo **out, int n)
+{
+	int got = 0, order = MEM_MAXORDER, i;
+
+	mcslock_acquire(&mem_buddylock);
+	while (got < n && order >= 0) {
+		pageinfo *pi = NULL;
+		if ((1 << order) <= n - got)
+			pi = mem_buddy_alloc(order);
+		if (pi == NULL) {
+			order--;
+			continue;
+		}
+		for (i = 0; i < (1 << order); i++)
+			out[got++] = pi + i;
+	}
+	mcslock_release(&mem_buddylock);
+	return got;
+}
+
+// Pages come from the same places as in mem_alloc(), in the same order:
+// this CPU's magazine, then the depot, the buddy allocator,
+// and finally the zeroed page pool.
+// Rather than refilling the magazine over and over,
+// we take everything the magazine can't cover
+// straight from the next level down in one operation.
+int
+mem_alloc_batch(int n, pageinfo **out)
+{
+	memcpu *mc = percpu_ptr(mem_cpu);
+	int got = MIN(n, mc->magcnt);
+	int i;
+
+	for (i = 0; i < got; i++)
+		out[i] = mc->mag[--mc->magcnt];
+	if (got < n)
+		got += mem_stack_pop(&mem_depot, out + got, n - got);
+	if (got < n)
+		got += mem_buddy_alloc_batch(out + got, n - got);
+	if (got < n)
+		got += mem_stack_pop(&mem_zeropool, out + got, n - got);
+	mc->batch_allocs += got;
+	if (got < n)
+		mc->mem_fails++;
+	return got;
+}
+
+// Fill up this CPU's magazine first, like mem_free() would,
+// then splice all the rest onto the depot in one update if it has room,
+// or give them to the buddy allocator with one acquisition of its lock.
+void
+mem_free_batch(pageinfo **pis, int n)
+{
+	memcpu *mc = percpu_ptr(mem_cpu);
+	int i;
+
+	for (i = 0; i < n; i++)
+		assert(pis[i]->refcount == 0);
+	mc->batch_frees += n;
+
+	int m = MIN(n, CPU_MAGSIZE - mc->magcnt);
+	for (i = 0; i < m; i++)
+		mc->mag[mc->magcnt++] = pis[i];
+	pis += m;
+	n -= m;
+	if (n == 0)
+		return;
+
+	if (mem_depot.npages + n <= MEM_DEPOTMAX)
+		mem_stack_push(&mem_depot, pis, n);
+	else {
+		mcslock_acquire(&mem_buddylock);
+		for (i = 0; i < n; i++)
+			mem_buddy_free(pis[i], 0);
+		mcslock_release(&mem_buddylock);
+	}
+}
+
+void
+mem_decref_batch(pageinfo **pis, int n)
+{
+	pageinfo *dead[MEM_MAGBATCH];
+	int ndead = 0, i;
+
+	for (i = 0; i < n; i++) {
+		pageinfo *pi = pis[i];
+		assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
+		assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+
+		int32_t old = xadd((volatile uint32_t*) &pi->refcount, -1);
+		assert(old > 0 && !(old & MEM_PI_FLAGS));
+		if (old == 1) {
+			dead[ndead++] = pi;
+			if (ndead == MEM_MAGBATCH) {
+				mem_free_batch(dead, ndead);
+				ndead = 0;
+			}
+		}
+	}
+	if (ndead > 0)
+		mem_free_batch(dead, ndead);
+}
+
+// Count the free pages held by the buddy allocator,
+// checking that each free list is consistent along the way.
+static size_t
+mem_check_count(void)
+{
+	pageinfo *pp;
+	size_t npages = 0;
+	int k;
+
+	for (k = 0; k < MEM_NORDER; k++) {
+		size_t nblocks = 0;
+		pageinfo *prev = NULL;
+		for (pp = mem_freelist[k]; pp != NULL; pp = mem_next(pp)) {
+			assert(mem_order(pp) == k);
+			assert(prev == NULL || mem_backlink(pp) == mem_index(prev));
+			assert((pp - mem_pageinfo) % (1 << k) == 0);
+			assert(mem_bitmap_scan(pp - mem_pageinfo, false)
+				>= (pp - mem_pageinfo) + (1 << k));
+			prev = pp;
+			nblocks++;
+		}
+		assert(nblocks == mem_nfree[k]);
+		npages += nblocks << k;
+	}
+
+	// Every page the free lists cover has its bit set in the bitmap,
+	// so if the number of bits set matches, that's all that's set.
+	size_t nbits = 0;
+	uint32_t w, bits;
+	for (w = 0; w < mem_nbitwords; w++) {
+		uint32_t sbit = 1 << (w % 32);
+		assert(!(mem_anymap[w / 32] & sbit) == (mem_freemap[w] == 0));
+		assert(!(mem_fullmap[w / 32] & sbit) == (mem_freemap[w] != ~0));
+		for (bits = mem_freemap[w]; bits != 0; bits &= bits - 1)
+			nbits++;
+	}
+	assert(nbits == npages);
+
+	return npages;
+}
+
+// Find out how many page colors the processor's largest cache has,
+// from the deterministic cache parameters in CPUID leaf 4.
+// The number of colors is the size of one way of the cache in pages,
+// since that's how far apart two addresses mapping to the same set are.
+// Without leaf 4 (e.g., on AMD processors) we just use one color.
+static void
+mem_color_init(void)
+{
+	cpuinfo inf;
+	uint32_t waysize = 0;
+	int i, level = 0;
+
+	cpuid(0, &inf);
+	if (inf.eax >= 4)
+		for (i = 0; ; i++) {
+			cpuid_sub(4, i, &inf);
+			int type = inf.eax & 0x1f;	// 1=data, 2=inst, 3=unified
+			int lev = (inf.eax >> 5) & 0x7;
+			if (type == 0)
+				break;			// no more caches
+			if (type == 2 || lev < level)
+				continue;
+			uint32_t line = (inf.ebx & 0xfff) + 1;
+			uint32_t parts = ((inf.ebx >> 12) & 0x3ff) + 1;
+			uint32_t sets = inf.ecx + 1;
+			waysize = line * parts * sets;
+			level = lev;
+		}
+
+	mem_ncolors = 1;
+	mem_colororder = 0;
+	while (mem_ncolors < MEM_MAXCOLORS &&
+			(mem_ncolors << 1) * PAGESIZE <= waysize) {
+		mem_ncolors <<= 1;
+		mem_colororder++;
+	}
+	cprintf("mem: %d page colors (L%d cache way %dK)\n",
+		mem_ncolors, level, waysize / 1024);
+}
+
+// Give any pages on the color lists back to the buddy allocator.
+// The caller must hold mem_colorlock.
+static void
+mem_color_drain(void)
+{
+	int i;
+
+	mcslock_acquire(&mem_buddylock);
+	for (i = 0; i < mem_ncolors; i++) {
+		pageinfo *pi;
+		while ((pi = mem_page_pop(&mem_colorlist[i])) != NULL)
+			mem_buddy_free(pi, 0);
+	}
+	mem_colornfree = 0;
+	mcslock_release(&mem_buddylock);
+}
+
+// Refill the empty color list for 'color'.
+// Normally we take a block of mem_ncolors pages from the buddy allocator,
+// which, being naturally aligned, has exactly one page of each color,
+// after giving any pages left over from the last block back to it.
+// But leftovers mean callers want some colors more than others,
+// so in that case we first look for a free page of just the color needed
+// in the free page bitmap, rather than break up a whole block for it.
+// The caller must hold mem_colorlock.
+static void
+mem_color_refill(int color)
+{
+	int i;
+
+	if (mem_colornfree > 0) {
+		uint32_t idx;
+		mcslock_acquire(&mem_buddylock);
+		while ((idx = mem_bitmap_find_color(color)) >= mem_npage &&
+				mem_lazy_expand())
+			;
+		if (idx < mem_npage)
+			mem_buddy_claim(idx, 1);
+		mcslock_release(&mem_buddylock);
+		if (idx < mem_npage) {
+			mem_page_push(&mem_colorlist[color], &mem_pageinfo[idx]);
+			mem_colornfree++;
+			return;
+		}
+	}
+
+	mem_color_drain();
+	pageinfo *pi = mem_alloc_order(mem_colororder);
+	if (pi == NULL)
+		return;
+	for (i = 0; i < mem_ncolors; i++) {
+		assert(mem_color(&pi[i]) == i && mem_colorlist[i] == NULL);
+		mem_page_push(&mem_colorlist[i], &pi[i]);
+	}
+	mem_colornfree = mem_ncolors;
+}
+
+pageinfo *
+mem_alloc_color(int color)
+{
+	assert(color >= 0 && color < mem_ncolors);
+
+	spinlock_acquire(&mem_colorlock);
+	if (mem_colorlist[color] == NULL)
+		mem_color_refill(color);
+	pageinfo *pi = mem_page_pop(&mem_colorlist[color]);
+	if (pi != NULL)
+		mem_colornfree--;
+	spinlock_release(&mem_colorlock);
+	return pi;
+}
+
+pageinfo *
+mem_alloc_zeroed(void)
+{
+	memcpu *mc = percpu_ptr(mem_cpu);
+	pageinfo *pi;
+
+	if (mem_stack_pop(&mem_zeropool, &pi, 1) > 0) {
+		mc->zero_hits++;
+		return pi;
+	}
+
+	mc->zero_misses++;
+	if ((pi = mem_alloc()) != NULL)
+		memset(mem_pi2ptr(pi), 0, PAGESIZE);
+	return pi;
+}
+
+bool
+mem_idle(void)
+{
+	memcpu *mc = percpu_ptr(mem_cpu);
+	pageinfo *pis[MEM_ZEROBATCH];
+	int n;
+
+	// Finish initializing physical memory a chunk at a time.
+	mcslock_acquire(&mem_buddylock);
+	bool expanded = mem_lazy_expand();
+	mcslock_release(&mem_buddylock);
+	if (expanded)
+		return true;
+
+	// Keep the pool of zeroed pages topped up,
+	// but don't tie up all free memory in it.
+	// Never take pages from the pool itself to zero them all over again:
+	// once nothing else is free, we're done until something is.
+	if (mem_zeropool.npages >= MEM_ZEROMAX)
+		return false;
+	for (n = 0; n < MEM_ZEROBATCH; n++) {
+		if (mc->magcnt == 0 && mem_mag_refill(mc, false) == 0)
+			break;
+		pis[n] = mc->mag[--mc->magcnt];
+		memset(mem_pi2ptr(pis[n]), 0, PAGESIZE);
+	}
+	if (n == 0)
+		return false;
+
+	mem_stack_push(&mem_zeropool, pis, n);
+	mc->zero_filled += n;
+	return true;
+}
+
+// Print a number of pages in kilobytes and as a percentage of a total.
+static void
+mem_stats_line(const char *what, size_t npages, size_t total)
+{
+	cprintf("mem_stats: %-12s %8dK %3d%%\n", what, npages * (PAGESIZE/1024),
+		total ? (int) ((uint64_t) npages * 100 / total) : 0);
+}
+
+void
+mem_stats(void)
+{
+	size_t nbuddy = 0;
+	int k;
+
+	// The free counts are each updated atomically or under a lock,
+	// so just reading them gives a consistent enough snapshot.
+	for (k = 0; k < MEM_NORDER; k++)
+		nbuddy += mem_nfree[k] << k;
+	size_t nmag = 0;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		nmag += percpu_of(c, mem_cpu)->magcnt;
+	size_t ncached = nmag + mem_depot.npages + mem_colornfree;
+	size_t nzero = mem_zeropool.npages;
+	size_t nlazy = mem_lazypages;
+	size_t nfree = nbuddy + ncached + nzero + nlazy;
+	size_t nalloc = nfree < mem_navail ? mem_navail - nfree : 0;
+
+	mem_stats_line("usable", mem_navail, mem_navail);
+	mem_stats_line("allocated", nalloc, mem_navail);
+	mem_stats_line("free", nbuddy, mem_navail);
+	mem_stats_line("cached", ncached, mem_navail);
+	mem_stats_line("zeroed", nzero, mem_navail);
+	mem_stats_line("uninit", nlazy, mem_navail);
+
+	cprintf("mem_stats: cpu   allocs   frees  refill   spill  "
+		"batch-a batch-f fail zero-hit\n");
+	int i;
+	for (c = &cpu_boot, i = 0; c != NULL; c = c->next, i++) {
+		memcpu *mc = percpu_of(c, mem_cpu);
+		cprintf("mem_stats: %3d %8d %7d %7d %7d %8d %7d %4d %4d/%d\n",
+			i, mc->mag_allocs, mc->mag_frees,
+			mc->mag_refills, mc->mag_spills,
+			mc->batch_allocs, mc->batch_frees, mc->mem_fails,
+			mc->zero_hits, mc->zero_hits + mc->zero_misses);
+	}
+
+	mcslock_stats(&mem_buddylock);
+	spinlock_stats(&mem_colorlock);
+#if !MEM_LOCKFREE
+	spinlock_stats(&mem_depot.lock);
+	spinlock_stats(&mem_zeropool.lock);
+#endif
+}
+
+// Set up the kmalloc() size classes.
+static void
+kmalloc_init(void)
+{
+	int cl;
+
+	for (cl = 0; cl < CPU_KMCLASSES; cl++) {
+		kmclass *kc = &kmalloc_classes[cl];
+		assert(kc->size % MEM_CACHELINE == 0);
+		assert(cl == 0 || kc->size > kmalloc_classes[cl-1].size);
+		spinlock_init(&kc->lock);
+		kc->perslab = SLAB_SPACE / kc->size;
+	}
+	assert(kmalloc_classes[CPU_KMCLASSES-1].size == KMALLOC_MAX);
+	static_assert(sizeof(slab) <= MEM_CACHELINE);
+}
+
+// Find the smallest size class that can hold a 'size'-byte object,
+// or return -1 if there is none.
+static int
+kmalloc_class(size_t size)
+{
+	int cl;
+
+	for (cl = 0; cl < CPU_KMCLASSES; cl++)
+		if (size <= kmalloc_classes[cl].size)
+			return cl;
+	return -1;
+}
+
+static void
+kmalloc_list_insert(slab **list, slab *s)
+{
+	s->next = *list;
+	s->prev = list;
+	if (s->next != NULL)
+		s->next->prev = &s->next;
+	*list = s;
+}
+
+static void
+kmalloc_list_remove(slab *s)
+{
+	*s->prev = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	s->next = NULL;
+	s->prev = NULL;
+}
+
+// Carve a new page into a slab of free objects
+// and put it on its class's partial list.
+// Each class cycles through the page colors for its slabs,
+// so that objects at the same offset in different slabs,
+// such as the first objects or the slab headers,
+// don't all compete for the same few cache sets.
+// The caller must hold kc->lock.
+static slab *
+kmalloc_slab_new(kmclass *kc)
+{
+	kc->color = (kc->color + 1) & (mem_ncolors - 1);
+	pageinfo *pi = mem_alloc_color(kc->color);
+	if (pi == NULL && (pi = mem_alloc()) == NULL)
+		return NULL;
+	mem_incref(pi);
+
+	slab *s = mem_pi2ptr(pi);
+	s->cls = kc;
+	s->inuse = 0;
+	s->magic = SLAB_MAGIC;
+
+	// Thread the objects onto the free list in address order.
+	void **link = &s->free;
+	char *obj = (char*)s + MEM_CACHELINE;
+	int i;
+	for (i = 0; i < kc->perslab; i++, obj += kc->size) {
+		*link = obj;
+		link = (void**)obj;
+	}
+	*link = NULL;
+
+	kmalloc_list_insert(&kc->partial, s);
+	kc->nslabs++;
+	kc->slaballocs++;
+	return s;
+}
+
+// Allocate one object directly from a class's slabs.
+// Partially used slabs come first, so that empty ones can be given back.
+// The caller must hold kc->lock.
+static void *
+kmalloc_slab_get(kmclass *kc)
+{
+	slab *s = kc->partial;
+	if (s == NULL) {
+		if ((s = kc->empty) != NULL) {
+			kc->empty = NULL;
+			kmalloc_list_insert(&kc->partial, s);
+		} else if ((s = kmalloc_slab_new(kc)) == NULL)
+			return NULL;
+	}
+
+	void *obj = s->free;
+	assert(obj != NULL);
+	s->free = *(void**)obj;
+	if (++s->inuse == kc->perslab)
+		kmalloc_list_remove(s);	// now full
+	kc->nobjs++;
+	return obj;
+}
+
+// Return one object to its slab.
+// A slab that becomes wholly free is kept in reserve if there is none yet,
+// and otherwise goes straight back to the page allocator.
+// The caller must hold kc->lock.
+static void
+kmalloc_slab_put(kmclass *kc, void *obj)
+{
+	slab *s = ROUNDDOWN(obj, PAGESIZE);
+	assert(s->cls == kc && s->inuse > 0);
+
+	*(void**)obj = s->free;
+	s->free = obj;
+	if (s->inuse-- == kc->perslab)
+		kmalloc_list_insert(&kc->partial, s);	// was full
+	kc->nobjs--;
+
+	if (s->inuse > 0)
+		return;
+	kmalloc_list_remove(s);
+	if (kc->empty == NULL) {
+		kc->empty = s;
+		return;
+	}
+	s->magic = 0;
+	kc->nslabs--;
+	kc->slabfrees++;
+	mem_decref(mem_ptr2pi(s), mem_free);
+}
+
+// Refill the current CPU's empty cache for class 'cl'
+// with KMALLOC_BATCH objects, returning the number we could get.
+static int
+kmalloc_refill(kmcache *km, int cl)
+{
+	kmclass *kc = &kmalloc_classes[cl];
+	int n;
+
+	assert(km->cache[cl].n == 0);
+	spinlock_acquire(&kc->lock);
+	for (n = 0; n < KMALLOC_BATCH; n++)
+		if ((km->cache[cl].obj[n] = kmalloc_slab_get(kc)) == NULL)
+			break;
+	spinlock_release(&kc->lock);
+
+	km->cache[cl].n = n;
+	return n;
+}
+
+// Return the 'count' coldest objects in the current CPU's cache
+// for class 'cl' to their slabs.
+static void
+kmalloc_spill(kmcache *km, int cl, int count)
+{
+	kmclass *kc = &kmalloc_classes[cl];
+	int i;
+
+	assert(count >= 0 && count <= km->cache[cl].n);
+	spinlock_acquire(&kc->lock);
+	for (i = 0; i < count; i++)
+		kmalloc_slab_put(kc, km->cache[cl].obj[i]);
+	spinlock_release(&kc->lock);
+
+	km->cache[cl].n -= count;
+	memmove(&km->cache[cl].obj[0], &km->cache[cl].obj[count],
+		km->cache[cl].n * sizeof(km->cache[cl].obj[0]));
+}
+
+void *
+kmalloc(size_t size)
+{
+	int cl = kmalloc_class(size);
+	if (cl < 0)
+		return NULL;
+
+	kmcache *km = percpu_ptr(kmalloc_cache);
+	km->allocs++;
+	if (km->cache[cl].n > 0)
+		km->allochits++;
+	else if (kmalloc_refill(km, cl) == 0)
+		return NULL;
+
+	return km->cache[cl].obj[--km->cache[cl].n];
+}
+
+void
+kfree(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	slab *s = ROUNDDOWN(ptr, PAGESIZE);
+	assert(s->magic == SLAB_MAGIC);
+	kmclass *kc = s->cls;
+	assert(((char*)ptr - (char*)s - MEM_CACHELINE) % kc->size == 0);
+	int cl = kc - kmalloc_classes;
+
+	kmcache *km = percpu_ptr(kmalloc_cache);
+	km->frees++;
+	if (km->cache[cl].n < CPU_KMCACHE)
+		km->freehits++;
+	else
+		kmalloc_spill(km, cl, KMALLOC_BATCH);
+
+	km->cache[cl].obj[km->cache[cl].n++] = ptr;
+}
+
+// Utilization is the fraction of slab object slots handed out
+// (to callers or to per-CPU caches).
+// Fragmentation is the fraction of slab memory not holding such objects,
+// whether it is free slots, slab headers, or leftover space at the end.
+void
+kmalloc_stats(void)
+{
+	kmcache *km = percpu_ptr(kmalloc_cache);
+	int cl;
+
+	cprintf("kmalloc:  size slabs  objects/slots  util  frag\n");
+	for (cl = 0; cl < CPU_KMCLASSES; cl++) {
+		kmclass *kc = &kmalloc_classes[cl];
+		spinlock_acquire(&kc->lock);
+		int slots = kc->nslabs * kc->perslab;
+		int util = slots ? kc->nobjs * 100 / slots : 0;
+		int frag = kc->nslabs ? 100 - kc->nobjs * kc->size * 100 /
+					(kc->nslabs * PAGESIZE) : 0;
+		cprintf("kmalloc: %5d %5d %8d/%-6d %3d%% %3d%%\n",
+			kc->size, kc->nslabs, kc->nobjs, slots, util, frag);
+		spinlock_release(&kc->lock);
+	}
+	cprintf("kmalloc: cpu cache hits: alloc %d/%d, free %d/%d\n",
+		km->allochits, km->allocs, km->freehits, km->frees);
 }
 
 //
@@ -178,20 +1764,38 @@ void
 mem_check()
 {
 	pageinfo *pp, *pp0, *pp1, *pp2;
-	pageinfo *fl;
-	int i;
+	pageinfo *fl[MEM_NORDER];
+	int i, k;
+
+	// Flush our magazine, the depot, and the zeroed pool
+	// so every free page is on a buddy free list.
+	memcpu *mc = percpu_ptr(mem_cpu);
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	mem_stack_drain(&mem_zeropool);
+	spinlock_acquire(&mem_colorlock);
+	mem_color_drain();
+	spinlock_release(&mem_colorlock);
+
+	// Leave uninitialized memory alone until the end,
+	// so the allocator doesn't grow more free pages while we count them.
+	uint32_t lazynext = mem_lazynext;
+	mem_lazynext = mem_nchunks;
 
         // if there's a page that shouldn't be on
         // the free list, try to make sure it
         // eventually causes trouble.
-	int freepages = 0;
-	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
-		memset(mem_pi2ptr(pp), 0x97, 128);
-		freepages++;
-	}
+	// (Leave the first word alone: it holds the block's back link.)
+	for (k = 0; k < MEM_NORDER; k++)
+		for (pp = mem_freelist[k]; pp != 0; pp = mem_next(pp))
+			for (i = 0; i < (1 << k); i++)
+				memset((uint32_t*) mem_pi2ptr(pp + i) + 1,
+					0x97, 124);
+	int freepages = mem_check_count();
 	cprintf("mem_check: %d free pages\n", freepages);
 	assert(freepages < mem_npage);	// can't have more free than total!
-	assert(freepages > 16000);	// make sure it's in the right ballpark
+	// make sure it's in the right ballpark
+	assert(freepages + mem_lazypages > 16000);
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -206,12 +1810,21 @@ mem_check()
         assert(mem_pi2phys(pp1) < mem_npage*PAGESIZE);
         assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
-	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = 0;
+	// temporarily steal the rest of the free pages,
+	// including any that the allocations above pulled into our magazine,
+	// by allocating every free block onto a private per-order list
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	for (k = 0; k < MEM_NORDER; k++) {
+		fl[k] = NULL;
+		while (mem_freelist[k] != NULL)
+			mem_page_push(&fl[k], mem_alloc_order(k));
+	}
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
+	for (k = 0; k < MEM_NORDER; k++)
+		assert(mem_alloc_order(k) == 0);
 
         // free and re-allocate?
         mem_free(pp0);
@@ -226,14 +1839,268 @@ mem_check()
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 	assert(mem_alloc() == 0);
 
+	// now exercise the buddy allocator on a single 4MB block,
+	// with nothing else free to interfere.
+	pageinfo *big = mem_page_pop(&fl[MEM_MAXORDER]);
+	assert(big != NULL);
+	mem_free_order(big, MEM_MAXORDER);
+	assert(mem_check_count() == 1 << MEM_MAXORDER);
+
+	// a single page should split the block into one free buddy per order
+	pp = mem_alloc_order(0);
+	assert(pp == big);
+	for (k = 0; k < MEM_MAXORDER; k++) {
+		assert(mem_nfree[k] == 1);
+		assert(mem_freelist[k] == big + (1 << k));
+	}
+	assert(mem_alloc_order(MEM_MAXORDER) == NULL);
+
+	// and freeing it should coalesce them all back together
+	mem_free_order(pp, 0);
+	assert(mem_nfree[MEM_MAXORDER] == 1 && mem_freelist[MEM_MAXORDER] == big);
+	assert(mem_check_count() == 1 << MEM_MAXORDER);
+
+	// blocks of every order come back naturally aligned and disjoint
+	pageinfo *blk[MEM_MAXORDER];
+	for (k = MEM_MAXORDER-1; k >= 0; k--) {
+		blk[k] = mem_alloc_order(k);
+		assert(blk[k] != NULL);
+		assert(mem_pi2phys(blk[k]) % (PAGESIZE << k) == 0);
+		assert(blk[k] >= big && blk[k] + (1 << k) <= big + (1 << MEM_MAXORDER));
+		for (i = k+1; i < MEM_MAXORDER; i++)
+			assert(blk[k] + (1 << k) <= blk[i] ||
+				blk[i] + (1 << i) <= blk[k]);
+	}
+	assert(mem_check_count() == 1);		// one order-0 page left over
+	for (k = 0; k < MEM_MAXORDER; k++)
+		mem_free_order(blk[k], k);
+	assert(mem_nfree[MEM_MAXORDER] == 1);
+
+	// carve the block into single pages and free them out of order:
+	// the allocator must still reassemble the whole 4MB block
+	pageinfo *pg = mem_alloc_order(MEM_MAXORDER);
+	assert(pg == big && mem_check_count() == 0);
+	for (i = 0; i < (1 << MEM_MAXORDER); i += 2)
+		mem_free_order(pg + i, 0);
+	assert(mem_nfree[0] == 1 << (MEM_MAXORDER-1));
+	for (i = (1 << MEM_MAXORDER) - 1; i > 0; i -= 2)
+		mem_free_order(pg + i, 0);
+	assert(mem_nfree[MEM_MAXORDER] == 1 && mem_freelist[MEM_MAXORDER] == big);
+	assert(mem_check_count() == 1 << MEM_MAXORDER);
+
 	// give free list back
-	mem_freelist = fl;
+	for (k = 0; k < MEM_NORDER; k++)
+		while ((pp = mem_page_pop(&fl[k])) != NULL)
+			mem_free_order(pp, k);
+	assert(mem_check_count() == freepages - 3);
 
 	// free the pages we took
 	mem_free(pp0);
 	mem_free(pp1);
 	mem_free(pp2);
 
+	// the magazine should now absorb a burst of frees and reallocations
+	// without going back to the buddy allocator more than once each way
+	pageinfo *pps[CPU_MAGSIZE];
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_check_count() == freepages);
+	uint32_t refills = mc->mag_refills, spills = mc->mag_spills;
+	for (i = 0; i < CPU_MAGSIZE; i++)
+		pps[i] = mem_alloc();
+	for (i = 0; i < CPU_MAGSIZE; i++)
+		mem_free(pps[i]);
+	for (i = 0; i < CPU_MAGSIZE; i++)
+		assert(mem_alloc() == pps[CPU_MAGSIZE-1-i]);
+	for (i = 0; i < CPU_MAGSIZE; i++)
+		mem_free(pps[i]);
+	assert(mc->mag_refills - refills == CPU_MAGSIZE / MEM_MAGBATCH);
+	assert(mc->mag_spills == spills);
+	// spills land in the depot and refills come back out of it
+	mem_mag_spill(mc, mc->magcnt);
+	assert(mem_depot.npages == CPU_MAGSIZE);
+	pp = mem_alloc();
+	assert(pp == pps[MEM_MAGBATCH-1]);
+	assert(mem_depot.npages == CPU_MAGSIZE - MEM_MAGBATCH);
+	mem_free(pp);
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_depot.npages == 0 && mem_depot.head.s.top == NULL);
+	assert(mem_check_count() == freepages);
+
+	// colored allocation should give us pages of the colors we ask for,
+	// whether we cycle through the colors or keep asking for the same one
+	pp0 = NULL;
+	for (i = 0; i < 2 * mem_ncolors + 16; i++) {
+		k = i < 2 * mem_ncolors ? i % mem_ncolors : 0;
+		pp = mem_alloc_color(k);
+		assert(pp != NULL && mem_color(pp) == k);
+		assert(pp->link == 0);
+		mem_page_push(&pp0, pp);
+	}
+	while ((pp = mem_page_pop(&pp0)) != NULL)
+		mem_free(pp);
+	spinlock_acquire(&mem_colorlock);
+	mem_color_drain();
+	spinlock_release(&mem_colorlock);
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_check_count() == freepages);
+
+	// bitmap searches should find aligned runs of free pages
+	// of any length, which mem_alloc_range() then takes off the free lists
+	static const struct { int npages, align; } ranges[] = {
+		{ 1, 1 }, { 3, 1 }, { 37, 1 }, { 100, 64 },
+		{ 1024, 1024 }, { 1500, 2 }, { 2000, 1024 },
+	};
+	for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+		int n = ranges[i].npages, align = ranges[i].align;
+		pageinfo *found = mem_find_free_range(n, align);
+		assert(found != NULL && (found - mem_pageinfo) % align == 0);
+		pp = mem_alloc_range(n, align);
+		assert(pp == found);
+		for (k = 0; k < n; k++)
+			assert(pp[k].link == 0);
+		assert(mem_bitmap_scan(pp - mem_pageinfo, true)
+			>= (pp - mem_pageinfo) + n);
+		assert(mem_check_count() == freepages - n);
+
+		// A run that includes an allocated page can't be used.
+		assert(mem_find_free_range(n, align) != pp);
+		mem_free_range(pp, n);
+		assert(mem_check_count() == freepages);
+	}
+	assert(mem_find_free_range(mem_npage, 1) == NULL);
+
+	// idle-time zeroing should fill the pool up to its limit,
+	// and mem_alloc_zeroed() should hand out zeroed pages with or without it
+	while (mem_idle())
+		;
+	assert(mem_zeropool.npages >= MEM_ZEROMAX);
+	uint32_t hits = mc->zero_hits, misses = mc->zero_misses;
+	for (i = 0; i < 2; i++) {
+		pp = mem_alloc_zeroed();
+		uint32_t *p = mem_pi2ptr(pp);
+		for (k = 0; k < PAGESIZE/sizeof(*p); k++)
+			assert(p[k] == 0);
+		p[0] = 0x97979797;	// dirty it so we know the next one's fresh
+		mem_free(pp);
+		mem_stack_drain(&mem_zeropool);	// second time around: a miss
+	}
+	assert(mc->zero_hits == hits + 1 && mc->zero_misses == misses + 1);
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_check_count() == freepages);
+	cprintf("mem_check: zeroed pool hits %d/%d\n",
+		mc->zero_hits, mc->zero_hits + mc->zero_misses);
+
+	// batch allocation should hand out distinct pages,
+	// more than the magazine holds, and batch frees should take them back
+	static pageinfo *batch[3 * CPU_MAGSIZE + 5];
+	const int nbatch = sizeof(batch) / sizeof(batch[0]);
+	assert(mem_alloc_batch(nbatch, batch) == nbatch);
+	for (i = 0; i < nbatch; i++) {
+		assert(batch[i]->link == 0);
+		for (k = 0; k < i; k++)
+			assert(batch[k] != batch[i]);
+		mem_incref(batch[i]);
+		if (i % 2)
+			mem_incref(batch[i]);
+	}
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_check_count() == freepages - nbatch);
+
+	// pages with two references should survive one batched decref
+	// (the others are free again, and their pageinfos may hold links)
+	mem_decref_batch(batch, nbatch);
+	for (i = 1; i < nbatch; i += 2)
+		assert(batch[i]->refcount == 1);
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_check_count() == freepages - nbatch/2);
+	for (i = k = 0; i < nbatch; i++)
+		if (i % 2)
+			batch[k++] = batch[i];
+	mem_decref_batch(batch, k);
+	mem_mag_spill(mc, mc->magcnt);
+	mem_stack_drain(&mem_depot);
+	assert(mem_check_count() == freepages);
+
+	// initializing another chunk should add its pages to the free lists
+	mem_lazynext = lazynext;
+	if (mem_lazypages > 0) {
+		size_t lazypages = mem_lazypages;
+		mcslock_acquire(&mem_buddylock);
+		assert(mem_lazy_expand());
+		mcslock_release(&mem_buddylock);
+		assert(mem_lazypages < lazypages);
+		assert(mem_check_count() == freepages + lazypages - mem_lazypages);
+	}
+
+	cprintf("mem_check: magazine hits: alloc %d/%d, free %d/%d\n",
+		mc->mag_allochits, mc->mag_allocs,
+		mc->mag_freehits, mc->mag_frees);
+
 	cprintf("mem_check() succeeded!\n");
 }
 
+//
+// Check the slab allocator behind kmalloc() and kfree().
+//
+static void
+kmalloc_check(void)
+{
+	static void *objs[200];
+	const int nobjs = sizeof(objs) / sizeof(objs[0]);
+	kmcache *km = percpu_ptr(kmalloc_cache);
+	int cl, i, j;
+
+	assert(kmalloc(KMALLOC_MAX + 1) == NULL);
+	assert(kmalloc_class(0) == 0);
+	assert(kmalloc_class(MEM_CACHELINE + 1) == 1);
+	assert(kmalloc_class(KMALLOC_MAX) == CPU_KMCLASSES-1);
+
+	for (cl = 0; cl < CPU_KMCLASSES; cl++) {
+		kmclass *kc = &kmalloc_classes[cl];
+		size_t size = kc->size;
+
+		// Allocate enough objects to need several slabs, and check
+		// that they are aligned, in the right class, and disjoint.
+		for (i = 0; i < nobjs; i++) {
+			char *p = objs[i] = kmalloc(size);
+			assert(p != NULL);
+			assert((uint32_t)p % MEM_CACHELINE == 0);
+			slab *s = (slab*)ROUNDDOWN(p, PAGESIZE);
+			assert(s->magic == SLAB_MAGIC && s->cls == kc);
+			assert(p + size <= (char*)s + PAGESIZE);
+			memset(p, i, size);
+		}
+		for (i = 0; i < nobjs; i++) {
+			uint8_t *p = objs[i];
+			for (j = 0; j < size; j++)
+				assert(p[j] == (uint8_t)i);
+		}
+		assert(kc->nslabs >= nobjs / kc->perslab);
+
+		// Once everything is freed, only the reserve slab should remain.
+		for (i = 0; i < nobjs; i++)
+			kfree(objs[i]);
+		kmalloc_spill(km, cl, km->cache[cl].n);
+		assert(kc->nobjs == 0 && kc->nslabs == 1);
+		assert(kc->partial == NULL && kc->empty != NULL);
+	}
+
+	// A freed object should be the next one handed out,
+	// without leaving this CPU.
+	uint32_t hits = km->allochits;
+	void *p = kmalloc(100);
+	kfree(p);
+	assert(kmalloc(100) == p);
+	assert(km->allochits == hits + 1);
+	kfree(p);
+	kfree(NULL);
+
+	kmalloc_stats();
+	cprintf("kmalloc_check() succeeded!\n");
+}
@@ -29,7 +29,8 @@
 // Given a physical address,
 // return a C pointer the kernel can use to access it.
 // This macro does nothing in PIOS because physical memory
-// is mapped into the kernel's virtual address space at address 0,
+// is mapped into the kernel's virtual address space at address 0
+// (see pmap_init()),
 // but this is not the case for many other systems such as JOS or Linux,
 // which must do some translation here (usually just adding an offset).
 #define mem_ptr(physaddr)	((void*)(physaddr))
@@ -38,16 +39,50 @@
 #define mem_phys(ptr)		((uint32_t)(ptr))
 
 
+// Set MEM_LOCKFREE to 0 to protect the global depot of free pages
+// with a spinlock instead of updating it lock-free with cmpxchg8b,
+// e.g., to compare the two with "make DEFS=-DMEM_LOCKFREE=0".
+#ifndef MEM_LOCKFREE
+#define MEM_LOCKFREE	1
+#endif
+
+// Set MEM_LAZYINIT to 0 to initialize all of physical memory in mem_init(),
+// instead of just enough to get going with the rest filled in on demand,
+// e.g., to compare boot times with "make DEFS=-DMEM_LAZYINIT=0".
+#ifndef MEM_LAZYINIT
+#define MEM_LAZYINIT	1
+#endif
+
+// The buddy allocator manages naturally aligned blocks of 2^order pages,
+// for orders 0 (a single 4KB page) through MEM_MAXORDER (4MB).
+#define MEM_MAXORDER	10
+#define MEM_NORDER	(MEM_MAXORDER+1)
+
 // A pageinfo struct holds metadata on how a particular physical page is used.
-// On boot we allocate a big array of pageinfo structs, one per physical page.
-// This could be a union instead of a struct,
-// since only one member is used for a given page state (free, allocated) -
-// but that might make debugging a bit more challenging.
+// On boot we allocate a big array of pageinfo structs, one per physical page,
+// so we keep each one down to a single 32-bit word,
+// used in one of three ways according to its top two bits:
+//  - A page that is allocated, or free but not on any list
+//    (e.g., in a CPU's magazine or in the middle of a larger free block),
+//    has both bits clear, and the rest of the word is its reference count.
+//  - The first page of a block on one of the buddy allocator's free lists
+//    has MEM_PI_BUDDY set, plus the block's order and the next block's index.
+//  - A free page on one of the other lists of free pages, such as the depot,
+//    has MEM_PI_LINKED set, plus the index of the next page on the list.
+// Page indexes fit in 20 bits, since we manage only the 4KB pages
+// below VM_USERLO (see inc/vm.h), 1GB of physical memory at most,
+// and index 0 ends a list, since page 0 is never free.
 typedef struct pageinfo {
-	struct pageinfo	*free_next;	// Next page number on free list
-	int32_t	refcount;		// Reference count on allocated pages
+	union {
+		int32_t		refcount;	// Reference count, if in use
+		uint32_t	link;		// Flags and free list link, if not
+	};
 } pageinfo;
 
+#define MEM_PI_BUDDY	0x80000000	// Heads a block on a buddy free list
+#define MEM_PI_LINKED	0x40000000	// On some other list of free pages
+#define MEM_PI_FLAGS	(MEM_PI_BUDDY | MEM_PI_LINKED)
+
 
 // The pmem module sets up the following globals during mem_init().
 extern size_t mem_max;		// Maximum physical address
@@ -78,6 +113,104 @@ pageinfo *mem_alloc(void);
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Allocate 'n' physical pages at once, storing their pageinfo pointers
+// in out[0..n-1], and return the number of pages allocated,
+// which is less than n only if there are no more free pages.
+// Much cheaper than calling mem_alloc() n times when n is large,
+// since pages come off the shared free lists a whole sublist at a time.
+int mem_alloc_batch(int n, pageinfo **out);
+
+// Free the 'n' pages in pis[], as if by calling mem_free() on each.
+void mem_free_batch(pageinfo **pis, int n);
+
+// Allocate a physical page whose contents are all zero.
+// Comes from a pool of pages zeroed in advance by idle CPUs if possible,
+// and otherwise zeroes a freshly allocated page synchronously.
+pageinfo *mem_alloc_zeroed(void);
+
+// Print a summary of where all physical memory is -
+// allocated, free in the buddy allocator, cached on the way to or from it,
+// or zeroed in advance - along with allocator statistics for each CPU.
+// The per-CPU counters are read without any synchronization,
+// so while other CPUs are busy allocating the totals are approximate.
+void mem_stats(void);
+
+// Do a bounded amount of background memory maintenance,
+// such as initializing more physical memory after a lazy start
+// or zeroing free pages for mem_alloc_zeroed().
+// CPUs with nothing better to do should call this from their idle loops.
+// Returns true if there may be more work to do.
+bool mem_idle(void);
+
+// Allocate a block of 2^order physically contiguous pages,
+// aligned on a (PAGESIZE << order) boundary,
+// and return the pageinfo struct for the first page in the block.
+// Returns NULL if no free block of that size is available.
+pageinfo *mem_alloc_order(int order);
+
+// Free a block of 2^order pages previously allocated with mem_alloc_order(),
+// coalescing it with its buddy blocks where possible.
+void mem_free_order(pageinfo *pi, int order);
+
+// Allocate a naturally aligned 4MB region of physical memory,
+// suitable for mapping with a single large (PSE) page directory entry,
+// and return the pageinfo struct for its first page.
+// Reference counts for the whole region are kept on that first page.
+// Returns NULL if no such region is free.
+pageinfo *mem_alloc_large(void);
+
+// Free a 4MB region allocated with mem_alloc_large().
+void mem_free_large(pageinfo *pi);
+
+// Find a run of 'npages' contiguous free pages starting on a multiple of
+// 'align' pages, where 'align' is a power of two, and return its first page.
+// Returns NULL if there is no such run among the buddy allocator's pages.
+// The pages stay free, so the answer may be stale by the time the caller
+// looks at it; use mem_alloc_range() to find and claim a run atomically.
+pageinfo *mem_find_free_range(int npages, int align);
+
+// Allocate 'npages' physically contiguous pages aligned on 'align' pages,
+// for any npages and any power-of-two alignment,
+// and return the pageinfo struct for the first page.
+// Returns NULL if no suitable run of free pages is available.
+pageinfo *mem_alloc_range(int npages, int align);
+
+// Free a run of pages allocated with mem_alloc_range().
+// (Freeing them individually with mem_free() works too.)
+void mem_free_range(pageinfo *pi, int npages);
+
+// Pages whose physical page numbers are congruent modulo mem_ncolors
+// have the same "color": they compete for the same sets in the cache,
+// so data that must stay cached together should be spread across colors.
+// mem_ncolors is a power of two no greater than MEM_MAXCOLORS.
+#define MEM_MAXCOLORS	128
+extern int mem_ncolors;
+#define mem_color(pi)	(((pi) - mem_pageinfo) & (mem_ncolors - 1))
+
+// Allocate a physical page of a given color, 0 <= color < mem_ncolors.
+// Returns NULL if no suitable page is available.
+// Colored pages are freed with mem_free() like any other.
+pageinfo *mem_alloc_color(int color);
+
+
+// Size of a cache line on the processors we care about.
+#define MEM_CACHELINE	64
+
+// Largest object kmalloc() will allocate.
+// Anything bigger should be allocated as whole pages instead.
+#define KMALLOC_MAX	1984
+
+// Allocate a kernel object of at least 'size' bytes from the slab allocator.
+// The object is aligned on a cache line boundary
+// and does not share any cache lines with other objects.
+// Returns NULL if size exceeds KMALLOC_MAX or memory is exhausted.
+void *kmalloc(size_t size);
+
+// Free an object allocated with kmalloc().  kfree(NULL) does nothing.
+void kfree(void *ptr);
+
+// Print utilization and fragmentation statistics for each kmalloc() class.
+void kmalloc_stats(void);
 
 
 // Atomically increment the reference count on a page.
@@ -86,6 +219,7 @@ mem_incref(pageinfo *pi)
 {
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+	assert(!(pi->link & MEM_PI_FLAGS));
 
 	lockadd(&pi->refcount, 1);
 }
@@ -98,10 +232,18 @@ mem_decref(pageinfo* pi, void (*freefun)(pageinfo *pi))
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
-	if (lockaddz(&pi->refcount, -1))
-			freefun(pi);
-	assert(pi->refcount >= 0);
+	// Once the count reaches zero the page may go straight onto a free list,
+	// so check the old count rather than looking at the page afterwards.
+	int32_t old = xadd((volatile uint32_t*) &pi->refcount, -1);
+	assert(old > 0 && !(old & MEM_PI_FLAGS));
+	if (old == 1)
+		freefun(pi);
 }
 
+// Decrement the reference counts on the 'n' pages in pis[],
+// collecting the ones that drop to zero and freeing them together
+// with mem_free_batch().
+void mem_decref_batch(pageinfo **pis, int n);
+
 
 #endif /* !PIOS_KERN_MEM_H */
@@ -0,0 +1,331 @@
+/*
+ * Memory allocator microbenchmarks.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/vm.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
+#include <kern/membench.h>
+
+
+#define MB_NPAGES	64	// Pages in the color benchmark's working set
+#define MB_NPASS	200	// Sweeps over the working set per measurement
+
+#define MB_SAMPLEORDER	2	// log2 of pages to hold latency samples in
+#define MB_NSAMPLES	((PAGESIZE << MB_SAMPLEORDER) / sizeof(uint32_t))
+#define MB_BATCH	64	// Pages per round in the batch benchmarks
+#define MB_NROUNDS	512	// Rounds in the batch benchmarks
+#define MB_NSLOTS	512	// Slots for live pages in the churn benchmark
+#define MB_NLARGE	4	// Large pages in the TLB benchmark's buffer
+#define MB_NTOUCH	(1 << 16)	// Page touches per TLB measurement
+
+
+// Sort an array of samples in place, using Shell sort with Knuth's gaps:
+// no recursion and no extra space, and fast enough for a few thousand.
+static void
+membench_sort(uint32_t *a, int n)
+{
+	int gap, i, j;
+
+	for (gap = 1; gap < n / 3; gap = gap * 3 + 1)
+		;
+	for (; gap > 0; gap /= 3)
+		for (i = gap; i < n; i++) {
+			uint32_t v = a[i];
+			for (j = i; j >= gap && a[j - gap] > v; j -= gap)
+				a[j] = a[j - gap];
+			a[j] = v;
+		}
+}
+
+// Print the median and 99th-percentile cycle counts of n samples.
+// misc/grade-membench.sh parses these lines, so keep the format stable.
+static void
+membench_report(const char *name, uint32_t *samples, int n)
+{
+	membench_sort(samples, n);
+	cprintf("membench: %-8s p50 %6d p99 %6d cycles\n",
+		name, samples[n / 2], samples[n * 99 / 100]);
+}
+
+// Return the cycles since t0, less the cost of reading the timestamp.
+static gcc_inline uint32_t
+membench_since(uint64_t t0, uint32_t overhead)
+{
+	uint32_t t = rdtsc() - t0;
+	return t > overhead ? t - overhead : 0;
+}
+
+// Measure how many cycles an empty measurement takes.
+static uint32_t
+membench_overhead(uint32_t *samples)
+{
+	int i;
+
+	for (i = 0; i < MB_NSAMPLES; i++)
+		samples[i] = membench_since(rdtsc(), 0);
+	membench_sort(samples, MB_NSAMPLES);
+	return samples[MB_NSAMPLES / 2];
+}
+
+// Simple linear congruential generator for the churn benchmarks.
+static gcc_inline uint32_t
+membench_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+// Latency of a mem_alloc() and mem_free() pair.
+static void
+membench_pair(uint32_t *samples, uint32_t overhead)
+{
+	int i;
+
+	for (i = 0; i < MB_NSAMPLES; i++) {
+		uint64_t t0 = rdtsc();
+		pageinfo *pi = mem_alloc();
+		assert(pi != NULL);
+		mem_free(pi);
+		samples[i] = membench_since(t0, overhead);
+	}
+	membench_report("pair", samples, MB_NSAMPLES);
+}
+
+// Cost per page of allocating MB_BATCH pages and then freeing them all,
+// either one at a time, which drains and refills the magazine,
+// or with the batch interfaces.
+static void
+membench_batch(uint32_t *samples, uint32_t overhead, bool batched)
+{
+	pageinfo *pis[MB_BATCH];
+	int r, i;
+
+	for (r = 0; r < MB_NROUNDS; r++) {
+		uint64_t t0 = rdtsc();
+		if (batched) {
+			assert(mem_alloc_batch(MB_BATCH, pis) == MB_BATCH);
+			mem_free_batch(pis, MB_BATCH);
+		} else {
+			for (i = 0; i < MB_BATCH; i++)
+				assert((pis[i] = mem_alloc()) != NULL);
+			for (i = 0; i < MB_BATCH; i++)
+				mem_free(pis[i]);
+		}
+		samples[r] = membench_since(t0, overhead) / MB_BATCH;
+	}
+	membench_report(batched ? "batch64" : "loop64", samples, MB_NROUNDS);
+}
+
+// Latency of each allocation or free in a random-lifetime workload:
+// each step picks a random slot and fills it if it's empty
+// or frees the page in it if not,
+// so live pages come and go in an unpredictable order.
+static void
+membench_churn(uint32_t *samples, uint32_t overhead, pageinfo **slots)
+{
+	uint32_t seed = 1;
+	int i;
+
+	memset(slots, 0, MB_NSLOTS * sizeof(slots[0]));
+	for (i = 0; i < MB_NSAMPLES; i++) {
+		pageinfo **slot = &slots[membench_rand(&seed) % MB_NSLOTS];
+		uint64_t t0 = rdtsc();
+		if (*slot != NULL) {
+			mem_free(*slot);
+			*slot = NULL;
+		} else
+			assert((*slot = mem_alloc()) != NULL);
+		samples[i] = membench_since(t0, overhead);
+	}
+	for (i = 0; i < MB_NSLOTS; i++)
+		if (slots[i] != NULL)
+			mem_free(slots[i]);
+	membench_report("churn", samples, MB_NSAMPLES);
+}
+
+// Latency of a kmalloc() and kfree() pair, of random sizes.
+static void
+membench_kmalloc(uint32_t *samples, uint32_t overhead)
+{
+	uint32_t seed = 1;
+	int i;
+
+	for (i = 0; i < MB_NSAMPLES; i++) {
+		size_t size = membench_rand(&seed) % KMALLOC_MAX + 1;
+		uint64_t t0 = rdtsc();
+		void *p = kmalloc(size);
+		assert(p != NULL);
+		kfree(p);
+		samples[i] = membench_since(t0, overhead);
+	}
+	membench_report("kmalloc", samples, MB_NSAMPLES);
+}
+
+
+// Read one word from every cache line of the given pages,
+// sweeping through them all 'npass' times,
+// and return the average number of cycles per line.
+static uint32_t
+membench_sweep(pageinfo **pis, int npages, int npass)
+{
+	const int nlines = PAGESIZE / MEM_CACHELINE;
+	uint32_t sum = 0;
+	int pass, i, j;
+
+	uint64_t t0 = rdtsc();
+	for (pass = 0; pass < npass; pass++)
+		for (i = 0; i < npages; i++) {
+			volatile uint32_t *p = mem_pi2ptr(pis[i]);
+			for (j = 0; j < nlines; j++)
+				sum += p[j * MEM_CACHELINE / sizeof(*p)];
+		}
+	uint64_t t = rdtsc() - t0;
+
+	return t / ((uint64_t) npass * npages * nlines);
+}
+
+// Compare a working set whose pages all have the same color
+// with one spread across as many colors as possible.
+// The working set is small enough to stay in the cache,
+// but more pages than the cache has ways,
+// so if it's all one color, every sweep evicts the lines it will need next.
+static void
+membench_color(void)
+{
+	static pageinfo *same[MB_NPAGES], *spread[MB_NPAGES];
+	int i;
+
+	if (mem_ncolors == 1) {
+		cprintf("membench: color: only one page color, skipping\n");
+		return;
+	}
+
+	for (i = 0; i < MB_NPAGES; i++) {
+		same[i] = mem_alloc_color(0);
+		spread[i] = mem_alloc_color(i % mem_ncolors);
+		assert(same[i] != NULL && spread[i] != NULL);
+	}
+
+	membench_sweep(same, MB_NPAGES, 1);	// warm up
+	uint32_t samecyc = membench_sweep(same, MB_NPAGES, MB_NPASS);
+	membench_sweep(spread, MB_NPAGES, 1);
+	uint32_t spreadcyc = membench_sweep(spread, MB_NPAGES, MB_NPASS);
+
+	cprintf("membench: color: %d pages of 1 color: %d cycles/line\n",
+		MB_NPAGES, samecyc);
+	cprintf("membench: color: %d pages of %d colors: %d cycles/line\n",
+		MB_NPAGES, MIN(MB_NPAGES, mem_ncolors), spreadcyc);
+
+	for (i = 0; i < MB_NPAGES; i++) {
+		mem_free(same[i]);
+		mem_free(spread[i]);
+	}
+}
+
+// Touch one cache line in each page of a buffer, in a scrambled order,
+// and return the average number of cycles per touch.
+// Each page gets a different line so that the data itself stays cached:
+// it's the page translations that don't fit in the TLB.
+static uint32_t
+membench_touch(uint8_t *buf, int npages)
+{
+	uint32_t x = 0, sum = 0;
+	int i;
+
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < MB_NTOUCH; i++) {
+		// A full-period LCG visits every page before repeating.
+		x = (x * 1103515245 + 12345) & (npages - 1);
+		sum += *(volatile uint32_t*) (buf + x * PAGESIZE
+				+ x % (PAGESIZE / MEM_CACHELINE) * MEM_CACHELINE);
+	}
+	return (rdtsc() - t0) / MB_NTOUCH;
+}
+
+// Compare TLB miss costs for a buffer mapped with ordinary 4KB pages
+// against one mapped with 4MB large pages.
+// We build a temporary page directory with the kernel's usual mappings
+// and the two buffers at the bottom of the user address space,
+// and switch to it just for the duration of the measurements.
+static void
+membench_tlb(void)
+{
+	const int npages = MB_NLARGE * NPTENTRIES;
+	const uint32_t va4k = VM_USERLO;
+	const uint32_t va4m = va4k + MB_NLARGE * PTSIZE;
+	int i;
+
+	pde_t *pdir = pmap_newpdir();
+	assert(pdir != NULL);
+
+	for (i = 0; i < npages; i++) {
+		pageinfo *pi = mem_alloc();
+		assert(pi != NULL);
+		assert(pmap_insert(pdir, pi, va4k + i * PAGESIZE, PTE_W));
+	}
+	for (i = 0; i < MB_NLARGE; i++) {
+		pageinfo *pi = mem_alloc_large();
+		assert(pi != NULL);
+		pmap_insert_large(pdir, pi, va4m + i * PTSIZE, PTE_W);
+	}
+
+	pde_t *opdir = cpu_cur()->pdir;
+	pmap_switch(pdir);
+
+	membench_touch((uint8_t*)va4k, npages);		// warm up
+	uint32_t cyc4k = membench_touch((uint8_t*)va4k, npages);
+	membench_touch((uint8_t*)va4m, npages);
+	uint32_t cyc4m = membench_touch((uint8_t*)va4m, npages);
+
+	pmap_switch(opdir);
+
+	cprintf("membench: tlb: %dMB in 4KB pages: %d cycles/touch\n",
+		MB_NLARGE * PTSIZE >> 20, cyc4k);
+	cprintf("membench: tlb: %dMB in 4MB pages: %d cycles/touch\n",
+		MB_NLARGE * PTSIZE >> 20, cyc4m);
+
+	pmap_freepdir(pdir);
+}
+
+void
+membench(void)
+{
+	// Each CPU gets its own sample and slot arrays,
+	// so that all CPUs can run the benchmarks at once.
+	pageinfo *spi = mem_alloc_order(MB_SAMPLEORDER);
+	pageinfo *slotpi = mem_alloc();
+	assert(spi != NULL && slotpi != NULL);
+	uint32_t *samples = mem_pi2ptr(spi);
+	pageinfo **slots = mem_pi2ptr(slotpi);
+	static_assert(MB_NSLOTS * sizeof(pageinfo*) <= PAGESIZE);
+
+	uint32_t overhead = membench_overhead(samples);
+	membench_pair(samples, overhead);
+	membench_batch(samples, overhead, false);
+	membench_batch(samples, overhead, true);
+	membench_churn(samples, overhead, slots);
+	membench_kmalloc(samples, overhead);
+
+	// The color and TLB benchmarks need the cache and TLB to themselves,
+	// and the color benchmark uses static arrays,
+	// so only the boot CPU runs them.
+	if (cpu_onboot()) {
+		membench_color();
+		membench_tlb();
+	}
+
+	mem_free(slotpi);
+	mem_free_order(spi, MB_SAMPLEORDER);
+	if (cpu_onboot())
+		mem_stats();
+	cprintf("membench() done\n");
+}
@@ -0,0 +1,21 @@
+/*
+ * Memory allocator microbenchmarks.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_MEMBENCH_H
+#define PIOS_KERN_MEMBENCH_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+
+// Run the memory benchmarks on the current CPU,
+// printing the results on the console.
+// Several CPUs may run them at once, to measure allocator scalability.
+// The kernel only runs these at boot if built with "make DEFS=-DMEMBENCH";
+// misc/grade-membench.sh does that and collects the results.
+void membench(void);
+
+#endif /* !PIOS_KERN_MEMBENCH_H */
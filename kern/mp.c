@@ -0,0 +1,141 @@
+/*
+ * Multiprocessor configuration discovery.
+ * See the Intel MultiProcessor Specification, version 1.4.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Adapted from xv6 and PIOS.
+ */
+
+#include <inc/x86.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mp.h>
+
+#include <dev/lapic.h>
+
+
+int mp_ncpu = 1;
+
+
+static uint8_t
+mp_sum(uint8_t *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += addr[i];
+	return sum;
+}
+
+// Look for an MP structure in the len bytes at addr.
+static mp *
+mp_search1(uint8_t *addr, int len)
+{
+	uint8_t *e, *p;
+
+	e = addr + len;
+	for (p = addr; p < e; p += sizeof(mp))
+		if (memcmp(p, "_MP_", 4) == 0 && mp_sum(p, sizeof(mp)) == 0)
+			return (mp *) p;
+	return NULL;
+}
+
+// Search for the MP Floating Pointer Structure, which according to the
+// spec is in one of the following three locations:
+// 1) in the first KB of the EBDA;
+// 2) in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xF0000 and 0xFFFFF.
+static mp *
+mp_search(void)
+{
+	uint8_t *bda;
+	uint32_t p;
+	mp *m;
+
+	bda = (uint8_t *) 0x400;
+	if ((p = ((bda[0x0F] << 8) | bda[0x0E]) << 4)) {
+		if ((m = mp_search1((uint8_t *) p, 1024)))
+			return m;
+	} else {
+		p = ((bda[0x14] << 8) | bda[0x13]) * 1024;
+		if ((m = mp_search1((uint8_t *) p - 1024, 1024)))
+			return m;
+	}
+	return mp_search1((uint8_t *) 0xF0000, 0x10000);
+}
+
+// Search for an MP configuration table.  For now,
+// don't accept the default configurations (physaddr == 0).
+// Check for correct signature, checksum, and version.
+static mpconf *
+mp_config(mp **pmp)
+{
+	mpconf *conf;
+	mp *m;
+
+	if ((m = mp_search()) == 0 || m->physaddr == 0)
+		return NULL;
+	conf = (mpconf *) m->physaddr;
+	if (memcmp(conf, "PCMP", 4) != 0)
+		return NULL;
+	if (conf->version != 1 && conf->version != 4)
+		return NULL;
+	if (mp_sum((uint8_t *) conf, conf->length) != 0)
+		return NULL;
+	*pmp = m;
+	return conf;
+}
+
+void
+mp_init(void)
+{
+	uint8_t *p, *e;
+	mp *m;
+	mpconf *conf;
+	mpproc *proc;
+
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	if ((conf = mp_config(&m)) == 0)
+		return;	// Not a multiprocessor machine - just use boot CPU.
+
+	lapic = (volatile uint32_t *) conf->lapicaddr;
+	for (p = (uint8_t *) (conf + 1), e = (uint8_t *) conf + conf->length;
+			p < e;) {
+		switch (*p) {
+		case MPPROC:
+			proc = (mpproc *) p;
+			p += sizeof(mpproc);
+			if (!(proc->flags & MPENAB))
+				continue;	// processor disabled
+
+			// Get a cpu struct and kernel stack for this CPU.
+			cpu *c = (proc->flags & MPBOOT)
+					? &cpu_boot : cpu_alloc();
+			c->id = proc->apicid;
+			if (c != &cpu_boot)
+				mp_ncpu++;
+			continue;
+		case MPBUS:
+		case MPIOAPIC:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			panic("mp_init: unknown config type %x\n", *p);
+		}
+	}
+	if (m->imcrp) {
+		// If the hardware implements PIC mode,
+		// switch to getting interrupts from the LAPIC.
+		outb(0x22, 0x70);		// Select IMCR
+		outb(0x23, inb(0x23) | 1);	// Mask external interrupts.
+	}
+	cprintf("mp_init: %d CPUs\n", mp_ncpu);
+}
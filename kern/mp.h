@@ -0,0 +1,80 @@
+/*
+ * Multiprocessor configuration discovery,
+ * from the MP Configuration Table the BIOS leaves in memory.
+ * See the Intel MultiProcessor Specification, version 1.4.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Adapted from xv6 and PIOS.
+ */
+
+#ifndef PIOS_KERN_MP_H
+#define PIOS_KERN_MP_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// MP Floating Pointer Structure, which tells us where to find the rest
+typedef struct mp {
+	uint8_t		signature[4];	// "_MP_"
+	uint32_t	physaddr;	// phys addr of MP config table
+	uint8_t		length;		// 1, in 16-byte units
+	uint8_t		specrev;	// [14]
+	uint8_t		checksum;	// all bytes must add up to 0
+	uint8_t		type;		// MP system config type
+	uint8_t		imcrp;		// bit 7: IMCR present
+	uint8_t		reserved[3];
+} mp;
+
+// MP Configuration Table header
+typedef struct mpconf {
+	uint8_t		signature[4];	// "PCMP"
+	uint16_t	length;		// total table length
+	uint8_t		version;	// [14]
+	uint8_t		checksum;	// all bytes must add up to 0
+	uint8_t		product[20];	// product id
+	uint32_t	oemtable;	// OEM table pointer
+	uint16_t	oemlength;	// OEM table length
+	uint16_t	entry;		// entry count
+	uint32_t	lapicaddr;	// address of local APIC
+	uint16_t	xlength;	// extended table length
+	uint8_t		xchecksum;	// extended table checksum
+	uint8_t		reserved;
+} mpconf;
+
+// Processor table entry
+typedef struct mpproc {
+	uint8_t		type;		// entry type (MPPROC)
+	uint8_t		apicid;		// local APIC id
+	uint8_t		version;	// local APIC version
+	uint8_t		flags;		// CPU flags
+	uint8_t		signature[4];	// CPU signature
+	uint32_t	feature;	// feature flags from CPUID instruction
+	uint8_t		reserved[8];
+} mpproc;
+
+#define MPENAB		0x01		// mpproc.flags: this processor is usable
+#define MPBOOT		0x02		// mpproc.flags: this is the boot processor
+
+// Table entry types
+#define MPPROC		0x00		// One per processor
+#define MPBUS		0x01		// One per bus
+#define MPIOAPIC	0x02		// One per I/O APIC
+#define MPIOINTR	0x03		// One per bus interrupt source
+#define MPLINTR		0x04		// One per system interrupt source
+
+
+// Number of usable processors we found, including the boot CPU.
+extern int mp_ncpu;
+
+// Find the other processors from the MP configuration table,
+// giving each one a cpu struct chained from cpu_boot,
+// and find the local APICs we use to start them up.
+// Only does anything on the boot CPU.
+// On a machine without the table, we simply run on the boot CPU alone.
+void mp_init(void);
+
+#endif /* !PIOS_KERN_MP_H */
@@ -0,0 +1,61 @@
+/*
+ * Multiboot specification definitions, for booting PIOS from GRUB
+ * or another multiboot-compliant boot loader instead of boot/boot.S.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_MULTIBOOT_H
+#define PIOS_KERN_MULTIBOOT_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+// Multiboot header flags and magic number (see kern/entry.S)
+#define MULTIBOOT_PAGE_ALIGN	(1<<0)	// align modules on page boundaries
+#define MULTIBOOT_MEMORY_INFO	(1<<1)	// request the memory map
+#define MULTIBOOT_HEADER_MAGIC	(0x1BADB002)
+#define MULTIBOOT_HEADER_FLAGS	(MULTIBOOT_MEMORY_INFO | MULTIBOOT_PAGE_ALIGN)
+
+// A multiboot loader passes this in EAX, and a multiboot_info pointer in EBX.
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+// multiboot_info.flags bits indicating which fields are valid
+#define MULTIBOOT_INFO_MEMORY	(1<<0)	// mem_lower, mem_upper
+#define MULTIBOOT_INFO_MEM_MAP	(1<<6)	// mmap_length, mmap_addr
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/cdefs.h>
+
+// Boot information structure the loader passes to the kernel.
+typedef struct multiboot_info {
+	uint32_t	flags;
+	uint32_t	mem_lower;	// KB of memory starting at 0
+	uint32_t	mem_upper;	// KB of memory starting at 1MB
+	uint32_t	boot_device;
+	uint32_t	cmdline;
+	uint32_t	mods_count;
+	uint32_t	mods_addr;
+	uint32_t	syms[4];
+	uint32_t	mmap_length;	// bytes of memory map entries
+	uint32_t	mmap_addr;	// physical address of first entry
+} multiboot_info;
+
+// A memory map entry: the same as a BIOS E820 entry,
+// but preceded by its size, not counting the size field itself.
+typedef struct multiboot_mmap {
+	uint32_t	size;
+	uint64_t	addr;
+	uint64_t	len;
+	uint32_t	type;		// 1 = usable RAM
+} gcc_packed multiboot_mmap;
+
+// The EAX and EBX values kern/entry.S found on entry from the boot loader.
+extern uint32_t multiboot_magic;
+extern uint32_t multiboot_infoaddr;
+
+#endif	// !__ASSEMBLER__
+
+#endif	// !PIOS_KERN_MULTIBOOT_H
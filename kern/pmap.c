@@ -0,0 +1,844 @@
+/*
+ * Page directory and page table management.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/vm.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
+#include <kern/trap.h>
+
+#include <dev/lapic.h>
+
+
+// A TLB invalidation covering more pages than this reloads CR3 instead:
+// past that point, refilling the TLB is cheaper than a run of invlpgs.
+#define PMAP_TLBMAXPAGES	32
+
+// pmap_remove() unhooks mappings first and drops their references
+// only after every TLB that might still hold them has been flushed,
+// so that no CPU can touch a page after it is freed.
+// It gathers up to this many at a time, each a physical address
+// tagged in its low bits with what kind of mapping it was.
+#define PMAP_GATHER	32
+#define PMAP_GPAGE	0	// a 4KB page
+#define PMAP_GLARGE	1	// a 4MB page
+#define PMAP_GPTAB	2	// a whole page table and what it maps
+
+
+pde_t pmap_bootpdir[NPDENTRIES] gcc_aligned(PAGESIZE);
+
+uint8_t pmap_zero[PAGESIZE] gcc_aligned(PAGESIZE);
+
+// Each CPU's TLB shootdown statistics (see pmap_stats()).
+typedef struct pmapstats {
+	uint32_t	shootdowns;	// shootdowns this CPU started
+	uint32_t	ipis;		// IPIs it sent for them
+	uint64_t	cycles;		// time it spent waiting for them
+	uint32_t	ranges;		// ranges it invalidated for others
+	uint32_t	flushes;	// ...and full flushes it did instead
+} pmapstats;
+static PERCPU pmapstats pmap_cpustats;
+
+
+// Add or drop a reference to the page a PTE maps.
+// Mappings of pmap_zero don't count: it's never freed,
+// and one refcount shared by every demand-zero page in the system
+// would be a hot spot in the cache for no benefit.
+static void
+pmap_incref(pte_t pte)
+{
+	if (PTE_ADDR(pte) != mem_phys(pmap_zero))
+		mem_incref(mem_phys2pi(PTE_ADDR(pte)));
+}
+
+static void
+pmap_decref(pte_t pte)
+{
+	if (PTE_ADDR(pte) != mem_phys(pmap_zero))
+		mem_decref(mem_phys2pi(PTE_ADDR(pte)), mem_free);
+}
+
+
+void
+pmap_init(void)
+{
+	int i;
+
+	if (cpu_onboot()) {
+		// Map all of physical memory the kernel uses at its own address,
+		// and the I/O devices at the top of the address space,
+		// with 4MB pages that are global so they outlive CR3 switches.
+		// Only the kernel may use these mappings:
+		// user code runs from pages of its own in [VM_USERLO, VM_USERHI).
+		for (i = 0; i < NPDENTRIES; i++) {
+			uint32_t va = (uint32_t) i << PDXSHIFT;
+			if (va == VM_VPT)
+				pmap_bootpdir[i] = mem_phys(pmap_bootpdir)
+						| PTE_P | PTE_W;
+			else if (va < VM_USERLO)
+				pmap_bootpdir[i] = va | PTE_P | PTE_W
+						| PTE_PS | PTE_G;
+			else if (va >= VM_USERHI)
+				pmap_bootpdir[i] = va | PTE_P | PTE_W
+						| PTE_PS | PTE_G;
+			else
+				pmap_bootpdir[i] = 0;
+		}
+	}
+
+	cpuinfo inf;
+	cpuid(1, &inf);
+	if (!(inf.edx & CPUID_PSE) || !(inf.edx & CPUID_PGE))
+		panic("pmap_init: processor lacks 4MB or global pages");
+
+	// Large and global pages have to be enabled before paging itself.
+	// With CR0_WP the kernel can't write to read-only pages either,
+	// which copy-on-write will depend on.
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
+	pmap_switch(pmap_bootpdir);
+	lcr0(rcr0() | CR0_PG | CR0_WP);
+}
+
+pde_t *
+pmap_newpdir(void)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return NULL;
+	mem_incref(pi);
+
+	pde_t *pdir = mem_pi2ptr(pi);
+	memmove(pdir, pmap_bootpdir, PAGESIZE);
+	pdir[PDX(VM_VPT)] = mem_pi2phys(pi) | PTE_P | PTE_W;
+	return pdir;
+}
+
+void
+pmap_freepdir(pde_t *pdir)
+{
+	assert(cpu_cur()->pdir != pdir);
+	pmap_remove(pdir, VM_USERLO, VM_USERHI - VM_USERLO);
+	mem_decref(mem_ptr2pi(pdir), mem_free);
+}
+
+void
+pmap_switch(pde_t *pdir)
+{
+	// Publish the new directory before loading it, and with a fence:
+	// anyone changing its mappings after we load it will see that
+	// they have to shoot down our TLB (see pmap_shootdown()).
+	xchg((volatile uint32_t*)&cpu_cur()->pdir, (uint32_t) pdir);
+	lcr3(mem_phys(pdir));
+}
+
+// Flush this CPU's TLB entries for [lo,hi).
+static void
+pmap_flushrange(uint32_t lo, uint32_t hi)
+{
+	if (hi - lo > PMAP_TLBMAXPAGES * PAGESIZE) {
+		tlbflush();
+		return;
+	}
+	for (; lo < hi; lo += PAGESIZE)
+		invlpg((void*)lo);
+}
+
+// Queue a TLB invalidation of [va,va+size) for CPU 'c',
+// merging it with an overlapping or adjacent range already queued,
+// or if there are too many of them, just asking for a full flush.
+// Returns true if the queue was empty, so 'c' needs an IPI to look at it.
+static bool
+pmap_tlbqueue(cpu *c, uint32_t va, size_t size)
+{
+	assert(spinlock_holding(&c->tlblock));
+	bool wasidle = c->tlbn == 0 && !c->tlball;
+	uint32_t lo = va, hi = va + size;
+	int i;
+
+	c->tlbreq++;
+	if (c->tlball)
+		return wasidle;
+	for (i = 0; i < c->tlbn; i++)
+		if (lo <= c->tlbhi[i] && c->tlblo[i] <= hi) {
+			c->tlblo[i] = MIN(c->tlblo[i], lo);
+			c->tlbhi[i] = MAX(c->tlbhi[i], hi);
+			break;
+		}
+	if (i == c->tlbn) {
+		if (c->tlbn == CPU_TLBRANGES) {
+			c->tlball = true;
+			return wasidle;
+		}
+		c->tlblo[i] = lo;
+		c->tlbhi[i] = hi;
+		c->tlbn++;
+	}
+
+	uint32_t npages = 0;
+	for (i = 0; i < c->tlbn; i++)
+		npages += (c->tlbhi[i] - c->tlblo[i]) / PAGESIZE;
+	if (npages > PMAP_TLBMAXPAGES)
+		c->tlball = true;
+	return wasidle;
+}
+
+void
+pmap_shootdown(pde_t *pdir, uint32_t va, size_t size)
+{
+	cpu *self = cpu_cur(), *c;
+	pmapstats *st = percpu_of(self, pmap_cpustats);
+	uint64_t t0 = rdtsc();
+	bool any = false;
+
+	// The caller's page table updates must be visible to other CPUs
+	// before we look at which page directory each one has loaded,
+	// just as pmap_switch() publishes that before loading it.
+	mfence();
+
+	// Queue the range for each CPU using 'pdir',
+	// and interrupt the ones that aren't already on their way.
+	// CPUs using other page directories hold no entries from this one,
+	// since loading CR3 flushed all of them.
+	// Our own shootdown IPI must stay out while we hold another CPU's lock,
+	// since that CPU might be holding our lock, spinning for its own.
+	// Traps all come in with interrupts disabled, but make sure.
+	uint32_t eflags = read_eflags();
+	cli();
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		if (c == self || c->pdir != pdir)
+			continue;
+		spinlock_acquire(&c->tlblock);
+		bool wasidle = pmap_tlbqueue(c, va, size);
+		spinlock_release(&c->tlblock);
+		if (wasidle) {
+			lapic_ipi(c->id, T_TLBFLUSH);
+			st->ipis++;
+		}
+		any = true;
+	}
+	write_eflags(eflags);
+	if (!any)
+		return;
+
+	// Wait for them all to finish.  Meanwhile carry out any shootdowns
+	// queued for us, in case one of them is waiting for us in turn.
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		if (c == self || c->pdir != pdir)
+			continue;
+		uint32_t want = c->tlbreq;
+		while ((int32_t) (c->tlbdone - want) < 0) {
+			pmap_tlbdrain();
+			pause();
+		}
+	}
+	st->shootdowns++;
+	st->cycles += rdtsc() - t0;
+}
+
+void
+pmap_tlbdrain(void)
+{
+	cpu *c = cpu_cur();
+	pmapstats *st = percpu_of(c, pmap_cpustats);
+	uint32_t lo[CPU_TLBRANGES], hi[CPU_TLBRANGES];
+
+	// Keep our own shootdown IPI from coming in while we hold the lock.
+	uint32_t eflags = read_eflags();
+	cli();
+
+	spinlock_acquire(&c->tlblock);
+	uint32_t req = c->tlbreq;
+	int n = c->tlbn, i;
+	bool all = c->tlball;
+	for (i = 0; i < n; i++) {
+		lo[i] = c->tlblo[i];
+		hi[i] = c->tlbhi[i];
+	}
+	c->tlbn = 0;
+	c->tlball = false;
+	spinlock_release(&c->tlblock);
+
+	if (all) {
+		tlbflush();
+		st->flushes++;
+	} else {
+		for (i = 0; i < n; i++)
+			pmap_flushrange(lo[i], hi[i]);
+		st->ranges += n;
+	}
+	c->tlbdone = req;
+
+	write_eflags(eflags);
+}
+
+// Flush [va,va+size) from this CPU's TLB if it's using 'pdir',
+// and from every other CPU that is.
+static void
+pmap_inval(pde_t *pdir, uint32_t va, size_t size)
+{
+	if (cpu_cur()->pdir == pdir)
+		pmap_flushrange(va, va + size);
+	pmap_shootdown(pdir, va, size);
+}
+
+pte_t *
+pmap_walk(pde_t *pdir, uint32_t va, bool writing)
+{
+	pde_t *pde = &pdir[PDX(va)];
+	if (*pde & PTE_PS)
+		return NULL;
+	if (!(*pde & PTE_P)) {
+		if (!writing)
+			return NULL;
+		pageinfo *pi = mem_alloc_zeroed();
+		if (pi == NULL)
+			return NULL;
+		mem_incref(pi);
+
+		// The page table entries restrict permissions as needed,
+		// so the directory entry can allow everything.
+		*pde = mem_pi2phys(pi) | PTE_P | PTE_W | PTE_U;
+	}
+
+	pte_t *ptab = mem_ptr(PDE_ADDR(*pde));
+	return &ptab[PTX(va)];
+}
+
+pte_t *
+pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t va, int perm)
+{
+	assert(PGOFF(va) == 0);
+
+	pte_t *pte = pmap_walk(pdir, va, true);
+	if (pte == NULL)
+		return NULL;
+
+	// Take the new reference first, in case pi is already mapped here.
+	mem_incref(pi);
+	if (*pte & PTE_P)
+		pmap_remove(pdir, va, PAGESIZE);
+
+	*pte = mem_pi2phys(pi) | perm | PTE_P;
+	return pte;
+}
+
+pde_t *
+pmap_insert_large(pde_t *pdir, pageinfo *pi, uint32_t va, int perm)
+{
+	assert(PTOFF(va) == 0);
+	assert(mem_pi2phys(pi) % PTSIZE == 0);
+
+	mem_incref(pi);
+	if (pdir[PDX(va)] & PTE_P)
+		pmap_remove(pdir, va, PTSIZE);
+
+	pdir[PDX(va)] = mem_pi2phys(pi) | perm | PTE_P | PTE_PS;
+	return &pdir[PDX(va)];
+}
+
+// Make a page or large page mapping copy-on-write if it is writable.
+static void
+pmap_share(uint32_t *pte)
+{
+	if (*pte & PTE_W)
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+}
+
+bool
+pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva, size_t size)
+{
+	assert(PGOFF(sva) == 0 && PGOFF(dva) == 0 && PGOFF(size) == 0);
+
+	pmap_remove(dpdir, dva, size);
+
+	uint32_t ssva = sva, send = sva + size;
+	while (sva < send) {
+		pde_t *spde = &spdir[PDX(sva)];
+		size_t n = MIN(send - sva, PTSIZE - PTOFF(sva));
+
+		if (!(*spde & PTE_P))
+			;	// nothing mapped here
+		else if (*spde & PTE_PS) {
+			assert(n == PTSIZE && PTOFF(dva) == 0);
+			pmap_share(spde);
+			mem_incref(mem_phys2pi(PDE_ADDR(*spde)));
+			dpdir[PDX(dva)] = *spde;
+		} else {
+			pte_t *spte = pmap_walk(spdir, sva, false);
+			size_t i;
+			for (i = 0; i < n; i += PAGESIZE, spte++) {
+				if (!(*spte & PTE_P))
+					continue;
+				pte_t *dpte = pmap_walk(dpdir, dva + i, true);
+				if (dpte == NULL) {
+					pmap_inval(spdir, ssva, sva - ssva + i);
+					return false;
+				}
+				pmap_share(spte);
+				pmap_incref(*spte);
+				*dpte = *spte;
+			}
+		}
+		sva += n;
+		dva += n;
+	}
+
+	// The source mappings lost write permission.
+	pmap_inval(spdir, ssva, size);
+	return true;
+}
+
+void
+pmap_stats(void)
+{
+	cprintf("pmap_stats: cpu shootdowns   IPIs cycles/each  ranges flushes\n");
+	cpu *c;
+	int i;
+	for (c = &cpu_boot, i = 0; c != NULL; c = c->next, i++) {
+		pmapstats *st = percpu_of(c, pmap_cpustats);
+		cprintf("pmap_stats: %3d %10d %6d %11d %7d %7d\n",
+			i, st->shootdowns, st->ipis,
+			st->shootdowns ? (uint32_t) (st->cycles /
+						st->shootdowns) : 0,
+			st->ranges, st->flushes);
+	}
+}
+
+void
+pmap_pagefault(trapframe *tf)
+{
+	uint32_t fva = rcr2();
+
+	// Only writes to pages that are present can be copy-on-write faults.
+	if ((tf->err & (PFE_PR | PFE_WR)) != (PFE_PR | PFE_WR))
+		return;
+
+	// The fault is in the current address space,
+	// so its page tables are right there in vpt[].
+	pde_t *pde = &vpd[PDX(fva)];
+	if (!(*pde & PTE_P))
+		return;
+	bool large = (*pde & PTE_PS) != 0;
+	uint32_t *pte = large ? pde : &vpt[VPN(fva)];
+
+	// Work from a snapshot of the entry, since another CPU sharing
+	// this address space can take the same fault at the same time:
+	// we only replace the entry if it still holds what we saw.
+	// That CPU may also have resolved the fault already, leaving us
+	// only a stale read-only TLB entry, which the fault itself flushed:
+	// just try again.
+	uint32_t old = *pte;
+	uint32_t need = PTE_P | PTE_W | (tf->err & PFE_U ? PTE_U : 0);
+	if ((old & need) == need)
+		trap_return(tf);
+
+	if ((old & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return;
+
+	uint32_t pa = large ? PDE_ADDR(old) : PTE_ADDR(old);
+	uint32_t perm = (old & ~PTE_COW & (PAGESIZE-1)) | PTE_W;
+	pageinfo *pi = mem_phys2pi(pa);
+	size_t size = large ? PTSIZE : PAGESIZE;
+	void (*freefun)(pageinfo *) = large ? mem_free_large : mem_free;
+
+	pageinfo *npi;
+	if (pa == mem_phys(pmap_zero)) {
+		// First write to a demand-zero page.
+		npi = mem_alloc_zeroed();
+		if (npi == NULL)
+			panic("pmap_pagefault: out of memory for a zero page");
+	} else if (pi->refcount == 1) {
+		// Nobody else has it any more, so we can just write to it.
+		// Other CPUs' read-only TLB entries for it are merely stale,
+		// so they need no shootdown (see above).
+		// If the entry changed under us, the fault will tell us what's next.
+		cmpxchg(pte, old, pa | perm);
+		invlpg((void*)fva);
+		trap_return(tf);
+	} else {
+		npi = large ? mem_alloc_large() : mem_alloc();
+		if (npi == NULL)
+			panic("pmap_pagefault: out of memory for a copy");
+		memmove(mem_pi2ptr(npi), mem_ptr(pa), size);
+	}
+	mem_incref(npi);
+	if (cmpxchg(pte, old, mem_pi2phys(npi) | perm) != old) {
+		// Someone beat us to it: drop our page and try again.
+		// Only the winner drops the reference to the old one.
+		mem_decref(npi, freefun);
+		trap_return(tf);
+	}
+
+	// A single invlpg flushes the mapping whether it's a large page or not.
+	// But other CPUs could still be reading the old page through theirs,
+	// so shoot those down before the old page can be freed.
+	invlpg((void*)fva);
+	pmap_shootdown(cpu_cur()->pdir, ROUNDDOWN(fva, size), size);
+	if (pa != mem_phys(pmap_zero))
+		mem_decref(pi, freefun);
+	trap_return(tf);
+}
+
+bool
+pmap_demandzero(pde_t *pdir, uint32_t va, size_t size, int perm)
+{
+	assert(PGOFF(va) == 0 && PGOFF(size) == 0);
+
+	pmap_remove(pdir, va, size);
+
+	pte_t zpte = mem_phys(pmap_zero) | PTE_P | (perm & ~PTE_W);
+	if (perm & PTE_W)
+		zpte |= PTE_COW;
+
+	size_t i;
+	for (i = 0; i < size; i += PAGESIZE) {
+		pte_t *pte = pmap_walk(pdir, va + i, true);
+		if (pte == NULL)
+			return false;
+		*pte = zpte;
+	}
+	return true;
+}
+
+void
+pmap_freeptab(pageinfo *ptabpi)
+{
+	pte_t *ptab = mem_pi2ptr(ptabpi);
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++)
+		if (ptab[i] & PTE_P)
+			pmap_decref(ptab[i]);
+	mem_free(ptabpi);
+}
+
+// Flush [va,va+size) from every TLB that might hold pdir's mappings,
+// then drop the 'n' references pmap_remove() gathered from that range.
+static void
+pmap_release(pde_t *pdir, uint32_t va, size_t size, uint32_t *gather, int n)
+{
+	pmap_inval(pdir, va, size);
+
+	int i;
+	for (i = 0; i < n; i++) {
+		uint32_t pa = PGADDR(gather[i]);
+		switch (PGOFF(gather[i])) {
+		case PMAP_GPAGE:
+			pmap_decref(pa);
+			break;
+		case PMAP_GLARGE:
+			mem_decref(mem_phys2pi(pa), mem_free_large);
+			break;
+		case PMAP_GPTAB:
+			mem_decref(mem_phys2pi(pa), pmap_freeptab);
+			break;
+		}
+	}
+}
+
+void
+pmap_remove(pde_t *pdir, uint32_t va, size_t size)
+{
+	assert(PGOFF(va) == 0 && PGOFF(size) == 0);
+
+	uint32_t gather[PMAP_GATHER];
+	int ngather = 0;
+
+	// Each time the batch fills up, release it along with
+	// the range [sva,va) it came from, before unhooking anything more.
+	uint32_t sva = va;
+	while (size > 0) {
+		pde_t *pde = &pdir[PDX(va)];
+		size_t n = MIN(size, PTSIZE - PTOFF(va));	// within this PDE
+
+		if (!(*pde & PTE_P))
+			;	// nothing mapped here
+		else if ((*pde & PTE_PS) || n == PTSIZE) {
+			// A large page, or a whole page table and everything
+			// it maps: either way just one PDE to unhook.
+			assert(n == PTSIZE);	// can't split a large page
+			if (ngather == PMAP_GATHER) {
+				pmap_release(pdir, sva, va - sva, gather, ngather);
+				ngather = 0;
+				sva = va;
+			}
+			gather[ngather++] = PDE_ADDR(*pde) |
+				(*pde & PTE_PS ? PMAP_GLARGE : PMAP_GPTAB);
+			*pde = 0;
+		} else {
+			pte_t *pte = pmap_walk(pdir, va, false);
+			size_t i;
+			for (i = 0; i < n; i += PAGESIZE, pte++) {
+				if (!(*pte & PTE_P))
+					continue;
+				if (ngather == PMAP_GATHER) {
+					pmap_release(pdir, sva, va + i - sva,
+							gather, ngather);
+					ngather = 0;
+					sva = va + i;
+				}
+				gather[ngather++] = PTE_ADDR(*pte) | PMAP_GPAGE;
+				*pte = 0;
+			}
+		}
+		va += n;
+		size -= n;
+	}
+	if (ngather > 0)
+		pmap_release(pdir, sva, va - sva, gather, ngather);
+}
+
+
+//
+// Check the page mapping functions.
+// They don't depend on paging being enabled,
+// so we just look at the page directory and tables they build.
+//
+void
+pmap_check(void)
+{
+	const uint32_t va = VM_USERLO;		// arbitrary, 4MB-aligned
+	int i;
+
+	// The kernel's own mappings cover all the memory we manage
+	// with supervisor-only global large pages, and leave user space empty.
+	assert(mem_max <= VM_USERLO);
+	assert(pmap_bootpdir[0] == (PTE_P | PTE_W | PTE_PS | PTE_G));
+	for (i = 0; i < NPDENTRIES; i++)
+		assert(!(pmap_bootpdir[i] & PTE_U));
+	assert(PDE_ADDR(pmap_bootpdir[PDX(mem_max-1)])
+		== ROUNDDOWN(mem_max-1, PTSIZE));
+	assert(pmap_bootpdir[PDX(VM_USERLO)] == 0);
+	assert(pmap_bootpdir[PDX(VM_USERHI-1)] == 0);
+	assert(pmap_bootpdir[PDX(VM_USERHI + PTSIZE)] & PTE_G);
+	assert(PDE_ADDR(pmap_bootpdir[PDX(VM_VPT)]) == mem_phys(pmap_bootpdir));
+	assert(!(pmap_bootpdir[PDX(VM_VPT)] & (PTE_U | PTE_PS | PTE_G)));
+
+	// Start with the kernel's mappings, so we can switch to this directory,
+	// and a recursive mapping of the directory itself.
+	pde_t *pdir = pmap_newpdir();
+	assert(pdir != NULL);
+	pageinfo *pdirpi = mem_ptr2pi(pdir);
+	assert(pdirpi->refcount == 1);
+	assert(PDE_ADDR(pdir[PDX(VM_VPT)]) == mem_phys(pdir));
+	assert(pdir[PDX(0)] == pmap_bootpdir[PDX(0)]);
+
+	// Hold references of our own on the pages we map,
+	// so they stay allocated and we can watch their counts throughout.
+	pageinfo *pi0 = mem_alloc(), *pi1 = mem_alloc();
+	assert(pi0 != NULL && pi1 != NULL && pi0 != pi1);
+	mem_incref(pi0);
+	mem_incref(pi1);
+
+	// Nothing is mapped yet, and walking without writing shouldn't change that
+	assert(pmap_walk(pdir, va, false) == NULL);
+	assert(pdir[PDX(va)] == 0);
+
+	// Mapping a page creates a page table and references the page
+	pte_t *pte = pmap_insert(pdir, pi0, va, PTE_W);
+	assert(pte != NULL && pte == pmap_walk(pdir, va, false));
+	assert(*pte == (mem_pi2phys(pi0) | PTE_W | PTE_P));
+	assert(pi0->refcount == 2);
+	pageinfo *ptabpi = mem_phys2pi(PDE_ADDR(pdir[PDX(va)]));
+	assert(ptabpi->refcount == 1);
+
+	// Mapping it again elsewhere adds another reference,
+	// and remapping the same place with the same page doesn't change that
+	assert(pmap_insert(pdir, pi0, va + PAGESIZE, PTE_W) != NULL);
+	assert(pi0->refcount == 3);
+	assert(pmap_insert(pdir, pi0, va, 0) == pte);
+	assert(pi0->refcount == 3 && *pte == (mem_pi2phys(pi0) | PTE_P));
+
+	// Replacing a mapping drops the old page's reference
+	assert(pmap_insert(pdir, pi1, va, PTE_W) == pte);
+	assert(pi0->refcount == 2 && pi1->refcount == 2);
+
+	// Removing part of a page table leaves the table in place
+	pmap_remove(pdir, va, PAGESIZE);
+	assert(*pte == 0 && pi1->refcount == 1);
+	assert(ptabpi->refcount == 1);
+
+	// A large page takes a single directory entry, replacing the page table
+	// and dropping the references it held
+	pageinfo *lpi = mem_alloc_large();
+	assert(lpi != NULL && mem_pi2phys(lpi) % PTSIZE == 0);
+	mem_incref(lpi);
+	pde_t *pde = pmap_insert_large(pdir, lpi, va, PTE_W);
+	assert(pde == &pdir[PDX(va)]);
+	assert(*pde == (mem_pi2phys(lpi) | PTE_W | PTE_P | PTE_PS));
+	assert(lpi->refcount == 2);
+	assert(pi0->refcount == 1);
+	assert(pmap_walk(pdir, va + PAGESIZE, false) == NULL);
+
+	// Removing a range spanning several directory entries
+	// drops the large page and any page tables in it
+	assert(pmap_insert(pdir, pi0, va + PTSIZE + PAGESIZE, PTE_W) != NULL);
+	ptabpi = mem_phys2pi(PDE_ADDR(pdir[PDX(va + PTSIZE)]));
+	assert(ptabpi->refcount == 1 && pi0->refcount == 2);
+	pmap_remove(pdir, va, 2 * PTSIZE);
+	assert(pdir[PDX(va)] == 0 && pdir[PDX(va + PTSIZE)] == 0);
+	assert(lpi->refcount == 1 && pi0->refcount == 1);
+
+	// Dropping the last reference to the large page
+	// gives it back to the buddy allocator in one piece
+	mem_decref(lpi, mem_free_large);
+	pageinfo *lpi2 = mem_alloc_large();
+	assert(lpi2 != NULL);
+	mem_free_large(lpi2);
+
+	// Copy-on-write sharing takes another reference on each page
+	// and makes writable mappings read-only on both sides,
+	// leaving read-only ones as they are
+	pde_t *pdir2 = pmap_newpdir();
+	assert(pdir2 != NULL);
+	assert(pmap_insert(pdir, pi0, va, PTE_W | PTE_U) != NULL);
+	assert(pmap_insert(pdir, pi1, va + PTSIZE + PAGESIZE, PTE_U) != NULL);
+	assert(pmap_insert(pdir2, pi1, va + PAGESIZE, PTE_W) != NULL);
+	assert(pi0->refcount == 2 && pi1->refcount == 3);
+	assert(pmap_copy(pdir, va, pdir2, va, 2 * PTSIZE));
+	pte = pmap_walk(pdir, va, false);
+	assert(*pte == (mem_pi2phys(pi0) | PTE_P | PTE_U | PTE_COW));
+	assert(*pmap_walk(pdir2, va, false) == *pte);
+	pte = pmap_walk(pdir, va + PTSIZE + PAGESIZE, false);
+	assert(*pte == (mem_pi2phys(pi1) | PTE_P | PTE_U));
+	assert(*pmap_walk(pdir2, va + PTSIZE + PAGESIZE, false) == *pte);
+	assert(*pmap_walk(pdir2, va + PAGESIZE, false) == 0);	// replaced
+	assert(pi0->refcount == 3 && pi1->refcount == 3);
+
+	// Large pages are shared the same way
+	lpi = mem_alloc_large();
+	assert(lpi != NULL);
+	mem_incref(lpi);
+	pmap_insert_large(pdir, lpi, va + 2 * PTSIZE, PTE_W);
+	assert(pmap_copy(pdir, va + 2 * PTSIZE, pdir2, va + 2 * PTSIZE, PTSIZE));
+	assert(pdir[PDX(va + 2 * PTSIZE)] == pdir2[PDX(va + 2 * PTSIZE)]);
+	assert(pdir[PDX(va + 2 * PTSIZE)] ==
+		(mem_pi2phys(lpi) | PTE_P | PTE_PS | PTE_COW));
+	assert(lpi->refcount == 3);
+
+	// With paging on, writes through a shared mapping get their own copy,
+	// and once nobody else shares a page, writes just go ahead
+	if (rcr0() & CR0_PG) {
+		volatile uint32_t *p = (uint32_t*) va;
+		volatile uint32_t *lp = (uint32_t*) (va + 2 * PTSIZE);
+		*(uint32_t*)mem_pi2ptr(pi0) = 1;
+		*(uint32_t*)mem_pi2ptr(lpi) = 1;
+		mem_decref(pi0, mem_free);	// drop our own references
+		mem_decref(lpi, mem_free_large);
+		pde_t *opdir = cpu_cur()->pdir;
+
+		pmap_switch(pdir2);
+		assert(PDE_ADDR(vpd[PDX(VM_VPT)]) == mem_phys(pdir2));
+		assert(vpt[VPN(va)] == *pmap_walk(pdir2, va, false));
+		assert(vpd[PDX(va + 2 * PTSIZE)] == pdir2[PDX(va + 2 * PTSIZE)]);
+		assert(*p == 1 && *lp == 1);
+		*p = 2;
+		*lp = 2;
+		assert(*p == 2 && *lp == 2);
+		pte = pmap_walk(pdir2, va, false);
+		assert(PTE_ADDR(*pte) != mem_pi2phys(pi0));
+		assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+		assert(pi0->refcount == 1 && lpi->refcount == 1);
+
+		pmap_switch(pdir);
+		assert(*p == 1 && *lp == 1);
+		*p = 3;
+		*lp = 3;
+		pte = pmap_walk(pdir, va, false);
+		assert(PTE_ADDR(*pte) == mem_pi2phys(pi0));
+		assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+		assert(PDE_ADDR(pdir[PDX(va + 2 * PTSIZE)]) == mem_pi2phys(lpi));
+		assert(*(uint32_t*)mem_pi2ptr(pi0) == 3);
+		assert(pi0->refcount == 1 && lpi->refcount == 1);
+
+		pmap_switch(opdir);
+		mem_incref(pi0);
+		mem_incref(lpi);
+	}
+	// Demand-zero pages all map pmap_zero, without reference counts,
+	// and sharing them copy-on-write leaves them that way
+	uint32_t zva = va + 3 * PTSIZE;
+	assert(pmap_demandzero(pdir, zva, 4 * PAGESIZE, PTE_W | PTE_U));
+	pte = pmap_walk(pdir, zva + PAGESIZE, false);
+	assert(*pte == (mem_phys(pmap_zero) | PTE_P | PTE_U | PTE_COW));
+	assert(pmap_copy(pdir, zva, pdir2, zva, PTSIZE));
+	assert(*pmap_walk(pdir2, zva + PAGESIZE, false) == *pte);
+	assert(pmap_demandzero(pdir2, zva + 2 * PAGESIZE, PAGESIZE, PTE_U));
+	assert(*pmap_walk(pdir2, zva + 2 * PAGESIZE, false)
+		== (mem_phys(pmap_zero) | PTE_P | PTE_U));
+
+	// Reads leave them alone, and the first write gets a page of its own
+	if (rcr0() & CR0_PG) {
+		volatile uint32_t *zp = (uint32_t*) (zva + PAGESIZE);
+		pde_t *opdir = cpu_cur()->pdir;
+
+		pmap_switch(pdir);
+		assert(zp[0] == 0 && zp[PAGESIZE/4 - 1] == 0);
+		assert(PTE_ADDR(*pte) == mem_phys(pmap_zero));
+		zp[1] = 5;
+		assert(PTE_ADDR(*pte) != mem_phys(pmap_zero));
+		assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+		assert(zp[0] == 0 && zp[1] == 5);
+
+		pmap_switch(pdir2);
+		assert(zp[1] == 0);
+		pmap_switch(opdir);
+		assert(pmap_zero[4] == 0);
+	}
+
+	// TLB shootdowns queued for a CPU merge into ranges where they can,
+	// and turn into a full flush when there are too many ranges or pages.
+	// Queue some for ourselves and carry them out directly.
+	cpu *c = cpu_cur();
+	pmapstats *st = percpu_of(c, pmap_cpustats);
+	uint32_t req = c->tlbreq, nflush = st->flushes;
+	spinlock_acquire(&c->tlblock);
+	assert(pmap_tlbqueue(c, va + PAGESIZE, PAGESIZE));
+	assert(!pmap_tlbqueue(c, va, PAGESIZE));		// adjacent
+	assert(!pmap_tlbqueue(c, va + PAGESIZE, 2 * PAGESIZE));	// overlapping
+	assert(c->tlbn == 1 && !c->tlball);
+	assert(c->tlblo[0] == va && c->tlbhi[0] == va + 3 * PAGESIZE);
+	for (i = 1; i < CPU_TLBRANGES; i++)
+		assert(!pmap_tlbqueue(c, va + i * PTSIZE, PAGESIZE));
+	assert(c->tlbn == CPU_TLBRANGES && !c->tlball);
+	assert(!pmap_tlbqueue(c, va + 2 * PTSIZE + PAGESIZE, PAGESIZE));
+	assert(c->tlbn == CPU_TLBRANGES && !c->tlball);
+	assert(!pmap_tlbqueue(c, va + 2 * PTSIZE + 4 * PAGESIZE, PAGESIZE));
+	assert(c->tlball);
+	spinlock_release(&c->tlblock);
+	pmap_tlbdrain();
+	assert(c->tlbn == 0 && !c->tlball && st->flushes == nflush + 1);
+	assert(c->tlbreq == req + CPU_TLBRANGES + 4 && c->tlbdone == c->tlbreq);
+
+	spinlock_acquire(&c->tlblock);
+	assert(pmap_tlbqueue(c, va, PMAP_TLBMAXPAGES * PAGESIZE));
+	assert(!c->tlball);
+	assert(!pmap_tlbqueue(c, va + PTSIZE, PAGESIZE));
+	assert(c->tlball);
+	spinlock_release(&c->tlblock);
+	pmap_tlbdrain();
+	assert(st->flushes == nflush + 2 && c->tlbdone == c->tlbreq);
+
+	pmap_remove(pdir, va, 4 * PTSIZE);
+	pmap_remove(pdir2, va, 4 * PTSIZE);
+	assert(pi0->refcount == 1 && pi1->refcount == 1 && lpi->refcount == 1);
+	mem_decref(lpi, mem_free_large);
+
+	mem_decref(pi0, mem_free);
+	mem_decref(pi1, mem_free);
+	pmap_freepdir(pdir);
+	pmap_freepdir(pdir2);
+
+	cprintf("pmap_check() succeeded!\n");
+}
@@ -0,0 +1,147 @@
+/*
+ * Page directory and page table management definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Primary author: Bryan Ford
+ */
+
+#ifndef PIOS_KERN_PMAP_H
+#define PIOS_KERN_PMAP_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/mmu.h>
+#include <inc/trap.h>
+
+#include <kern/mem.h>
+
+
+// Page directory entries and page table entries are 32-bit integers.
+typedef uint32_t pde_t;
+typedef uint32_t pte_t;
+
+// The kernel's page directory, with just the mappings common to all of them.
+extern pde_t pmap_bootpdir[NPDENTRIES];
+
+// Each page directory maps itself at VM_VPT with one of its own entries,
+// so the current address space's page tables appear there as one linear
+// array of PTEs: vpt[VPN(va)] is the entry mapping 'va', in one load,
+// as long as vpd[VPD(va)] - the page directory entry - is present
+// and not a large page.
+#define vpt		((pte_t*) VM_VPT)
+#define vpd		((pde_t*) (VM_VPT + (VPD(VM_VPT) << PAGESHIFT)))
+
+// A page of zeros, mapped read-only wherever demand-zero memory
+// hasn't been written yet (see pmap_demandzero()).
+// It lives in the kernel's BSS, and its mappings aren't reference counted.
+extern uint8_t pmap_zero[PAGESIZE];
+
+// A page mapped copy-on-write has PTE_W clear, so writes to it fault,
+// and this software-defined bit set, so pmap_pagefault() knows
+// the mapping is really writable once it has a page of its own.
+// Large pages can be copy-on-write too, with the bit in the PDE.
+#define PTE_COW		0x200
+
+// Physical address a present PDE or PTE points to.
+#define PDE_ADDR(pde)	((pde) & ((pde) & PTE_PS ? ~(PTSIZE-1) : ~(PAGESIZE-1)))
+#define PTE_ADDR(pte)	PGADDR(pte)
+
+
+// Set up the kernel's page directory on the boot CPU,
+// and turn on paging with it on each CPU.
+void pmap_init(void);
+
+// Allocate a page directory with the kernel's mappings and no others.
+// Returns NULL if out of memory.
+pde_t *pmap_newpdir(void);
+
+// Free a page directory from pmap_newpdir() and all of its user mappings.
+// No CPU may be using it.
+void pmap_freepdir(pde_t *pdir);
+
+// Load page directory 'pdir' into this CPU's CR3,
+// recording it so that changes to its mappings shoot down our TLB.
+void pmap_switch(pde_t *pdir);
+
+// Make every other CPU that has 'pdir' loaded flush [va,va+size)
+// from its TLB, and wait until they all have.
+// Each target CPU's requests pile up in a queue, merged into ranges,
+// and it gets only one IPI until it has worked through them;
+// when the queue overflows or covers too many pages,
+// the target just reloads CR3 instead.
+// The functions below that change mappings call this themselves.
+void pmap_shootdown(pde_t *pdir, uint32_t va, size_t size);
+
+// Carry out the TLB shootdowns other CPUs have queued for this one.
+// Called from trap() on a T_TLBFLUSH interrupt,
+// and by CPUs waiting in pmap_shootdown().
+void pmap_tlbdrain(void);
+
+// Print each CPU's TLB shootdown counts and average latency.
+void pmap_stats(void);
+
+// Find the page table entry for virtual address 'va' in page directory 'pdir'.
+// If there's no page table covering 'va' yet and 'writing' is true,
+// allocate and install a zeroed one; otherwise return NULL.
+// Also returns NULL if 'va' is covered by a large page,
+// or if no memory is available for a new page table.
+pte_t *pmap_walk(pde_t *pdir, uint32_t va, bool writing);
+
+// Map the physical page 'pi' at virtual address 'va' with permissions 'perm',
+// replacing any existing mapping and adding a reference to 'pi'.
+// Returns a pointer to the new page table entry,
+// or NULL if we couldn't allocate a page table.
+pte_t *pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t va, int perm);
+
+// Map the 4MB region 'pi' from mem_alloc_large() at the 4MB-aligned
+// virtual address 'va' with a single large-page directory entry,
+// replacing any existing mappings and adding a reference to 'pi'.
+// Requires CR4_PSE to be set before the mapping is used.
+pde_t *pmap_insert_large(pde_t *pdir, pageinfo *pi, uint32_t va, int perm);
+
+// Unmap the page-aligned virtual address range [va,va+size),
+// dropping a reference to each page that was mapped there
+// once no TLB can still be using it.
+// Page tables wholly within the range are freed as well.
+// Large pages can only be removed in their entirety.
+void pmap_remove(pde_t *pdir, uint32_t va, size_t size);
+
+// Share the mappings in [sva,sva+size) of page directory 'spdir'
+// with [dva,dva+size) of 'dpdir', copy-on-write,
+// replacing whatever was mapped in the destination range.
+// Both mappings of a writable page become read-only and PTE_COW,
+// and the page gets another reference, so nothing is actually copied
+// until one side writes to it.
+// The addresses and size must be page-aligned,
+// and 4MB-aligned wherever the source range has large pages.
+// Returns false if we run out of memory for page tables,
+// leaving the destination range partly copied.
+bool pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size);
+
+// Map every page of [va,va+size) to pmap_zero with permissions 'perm',
+// replacing whatever was mapped there.
+// Reads see zeros without any memory being allocated for them,
+// and if 'perm' includes PTE_W the pages are mapped copy-on-write,
+// so that the first write to each one gets it a zeroed page of its own.
+// Returns false if we run out of memory for page tables.
+bool pmap_demandzero(pde_t *pdir, uint32_t va, size_t size, int perm);
+
+// Handle a page fault from trap() if it's a write to a copy-on-write page,
+// including a demand-zero one,
+// by giving the faulting mapping a writable page of its own
+// and resuming the faulting code.
+// Returns only if the fault is something else.
+void pmap_pagefault(trapframe *tf);
+
+// Free a page table and release the pages it maps,
+// once there are no more references to it.
+void pmap_freeptab(pageinfo *ptabpi);
+
+// Check the page mapping functions for correct operation.
+void pmap_check(void);
+
+#endif /* !PIOS_KERN_PMAP_H */
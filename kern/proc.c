@@ -0,0 +1,348 @@
+/*
+ * Processes and their scheduling.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/init.h>
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
+#include <kern/kpar.h>
+#include <kern/proc.h>
+#include <kern/trap.h>
+
+#include <dev/lapic.h>
+
+
+// Each CPU's scheduler statistics (see proc_stats()).
+typedef struct procstats {
+	uint32_t	runs;		// times it started or resumed a process
+	uint32_t	preempts;	// processes it preempted
+	uint32_t	pulls;		// processes it took from other CPUs
+	uint64_t	idle;		// cycles it spent halted
+} procstats;
+static PERCPU procstats proc_cpustats;
+
+static int proc_check_phase;	// proc_check() progress, if it's running
+static void proc_check_tick(void);
+
+void
+proc_init(void)
+{
+	lapic_timer(PROC_HZ);
+}
+
+proc *
+proc_alloc(const void *code, size_t size, uint32_t arg)
+{
+	assert(size <= PAGESIZE);
+	proc *p = kmalloc(sizeof(proc));
+	if (p == NULL)
+		return NULL;
+	memset(p, 0, sizeof(proc));
+
+	// Both pages start out zeroed, so no kernel data leaks into them.
+	pageinfo *cpi, *spi;
+	if ((p->pdir = pmap_newpdir()) == NULL)
+		goto nomem;
+	if ((cpi = mem_alloc_zeroed()) == NULL)
+		goto nomem;
+	memmove(mem_pi2ptr(cpi), code, size);
+	if (pmap_insert(p->pdir, cpi, PROC_CODE, PTE_U) == NULL) {
+		mem_free(cpi);
+		goto nomem;
+	}
+	if ((spi = mem_alloc_zeroed()) == NULL)
+		goto nomem;
+	if (pmap_insert(p->pdir, spi, PROC_STACKHI - PAGESIZE,
+			PTE_W | PTE_U) == NULL) {
+		mem_free(spi);
+		goto nomem;
+	}
+
+	// Start with 'arg' on the stack where 'entry' expects it,
+	// below a null return address.
+	uint32_t *stk = (uint32_t*) ((char*) mem_pi2ptr(spi) + PAGESIZE);
+	stk[-1] = arg;
+	stk[-2] = 0;
+
+	p->tf.gs = CPU_GDT_UDATA | 3;
+	p->tf.fs = CPU_GDT_UDATA | 3;
+	p->tf.es = CPU_GDT_UDATA | 3;
+	p->tf.ds = CPU_GDT_UDATA | 3;
+	p->tf.cs = CPU_GDT_UCODE | 3;
+	p->tf.ss = CPU_GDT_UDATA | 3;
+	p->tf.eflags = FL_IF;
+	p->tf.eip = PROC_CODE;
+	p->tf.esp = PROC_STACKHI - 2*sizeof(uint32_t);
+	return p;
+
+nomem:
+	if (p->pdir != NULL)
+		pmap_freepdir(p->pdir);
+	kfree(p);
+	return NULL;
+}
+
+// Add a process to the tail of a CPU's run queue.
+static void
+proc_enqueue(cpu *c, proc *p)
+{
+	spinlock_acquire(&c->rqlock);
+	p->state = PROC_READY;
+	p->runcpu = c;
+	p->readynext = NULL;
+	if (c->rqtail != NULL)
+		c->rqtail->readynext = p;
+	else
+		c->rqhead = p;
+	c->rqtail = p;
+	c->rqlen++;
+	spinlock_release(&c->rqlock);
+}
+
+// Take the process at the head of a CPU's run queue, if any.
+static proc *
+proc_dequeue(cpu *c)
+{
+	if (c->rqlen == 0)
+		return NULL;	// don't bother with the lock
+
+	spinlock_acquire(&c->rqlock);
+	proc *p = c->rqhead;
+	if (p != NULL) {
+		if ((c->rqhead = p->readynext) == NULL)
+			c->rqtail = NULL;
+		c->rqlen--;
+	}
+	spinlock_release(&c->rqlock);
+	return p;
+}
+
+void
+proc_ready(proc *p)
+{
+	proc_enqueue(cpu_cur(), p);
+}
+
+// Migrate processes from the busiest other CPU's run queue to ours,
+// enough to even out the two CPUs' loads, counting their running processes.
+// We only ever hold one run queue lock at a time,
+// so CPUs balancing against each other can't deadlock.
+static void
+proc_balance(cpu *c)
+{
+	cpu *v, *busiest = NULL;
+	int most = 0;
+	for (v = &cpu_boot; v != NULL; v = v->next)
+		if (v != c && v->rqlen > most) {
+			busiest = v;
+			most = v->rqlen;
+		}
+	if (busiest == NULL)
+		return;
+	int n = (most + 1 - c->rqlen - (c->proc != NULL)) / 2;
+	if (n <= 0)
+		return;
+
+	// Take the processes that would have run next there,
+	// leaving any pinned ones behind.
+	proc *moved = NULL, *p, *prev = NULL, **pp;
+	spinlock_acquire(&busiest->rqlock);
+	pp = &busiest->rqhead;
+	while (n > 0 && (p = *pp) != NULL) {
+		if (p->pinned) {
+			prev = p;
+			pp = &p->readynext;
+			continue;
+		}
+		*pp = p->readynext;
+		if (busiest->rqtail == p)
+			busiest->rqtail = prev;
+		busiest->rqlen--;
+		p->readynext = moved;
+		moved = p;
+		n--;
+	}
+	spinlock_release(&busiest->rqlock);
+
+	while ((p = moved) != NULL) {
+		moved = p->readynext;
+		proc_enqueue(c, p);
+		percpu_of(c, proc_cpustats)->pulls++;
+	}
+}
+
+// Resume running a process in user mode on this CPU.
+static void gcc_noreturn
+proc_run(proc *p)
+{
+	cpu *c = cpu_cur();
+
+	p->state = PROC_RUN;
+	p->runcpu = c;
+	c->proc = p;
+	percpu_of(c, proc_cpustats)->runs++;
+	if (c->pdir != p->pdir)
+		pmap_switch(p->pdir);
+	trap_return(&p->tf);
+}
+
+void gcc_noreturn
+proc_sched(void)
+{
+	cpu *c = cpu_cur();
+	c->proc = NULL;
+
+	while (1) {
+		proc *p = proc_dequeue(c);
+		if (p == NULL) {
+			proc_balance(c);
+			p = proc_dequeue(c);
+		}
+		if (p != NULL)
+			proc_run(p);
+
+		// Nothing to run: drop the last process's address space,
+		// so its shootdowns stop interrupting us,
+		// then help out with anything else going on,
+		// or sleep until the next timer tick or wakeup.
+		if (c->pdir != pmap_bootpdir)
+			pmap_switch(pmap_bootpdir);
+		if (!kpar_work() && !mem_idle()) {
+			uint64_t t0 = rdtsc();
+			sti_hlt();
+			cli();
+			percpu_of(c, proc_cpustats)->idle += rdtsc() - t0;
+		}
+	}
+}
+
+void
+proc_tick(trapframe *tf)
+{
+	cpu *c = cpu_cur();
+
+	if (c == &cpu_boot && proc_check_phase != 0)
+		proc_check_tick();
+	if (++c->ticks % PROC_BALANCE == 0)
+		proc_balance(c);
+
+	// Only a process running in user mode gets preempted,
+	// and only if something else is waiting for the CPU.
+	proc *p = c->proc;
+	if (p == NULL || (tf->cs & 3) == 0)
+		return;
+	if (++p->ticks < PROC_TIMESLICE || c->rqlen == 0)
+		return;
+	p->ticks = 0;
+
+	// Save its state and put it at the back of the line.
+	// Once it's on the run queue another CPU may take it,
+	// so we have to be done with it by then.
+	p->tf = *tf;
+	c->proc = NULL;
+	percpu_of(c, proc_cpustats)->preempts++;
+	proc_enqueue(c, p);
+	proc_sched();
+}
+
+void
+proc_stats(void)
+{
+	cprintf("proc_stats: cpu   ticks    runs preempts  pulls   idle cycles\n");
+	cpu *c;
+	int i;
+	for (c = &cpu_boot, i = 0; c != NULL; c = c->next, i++) {
+		procstats *st = percpu_of(c, proc_cpustats);
+		cprintf("proc_stats: %3d %7d %7d %8d %6d %13lld\n",
+			i, c->ticks, st->runs, st->preempts,
+			st->pulls, st->idle);
+	}
+}
+
+
+#define PROC_NCHECK	8	// Processes proc_check() starts
+
+// proc_check()'s processes, and their counts as proc_check_tick() last saw.
+static proc *proc_check_procs[PROC_NCHECK];
+static uint32_t proc_check_seen[PROC_NCHECK];
+
+// Each of proc_check()'s processes just counts, forever, in user mode,
+// in the first word of its stack page, where it doesn't get in the way.
+#define PROC_CHECKCOUNT	(PROC_STACKHI - PAGESIZE)
+
+void
+proc_check(void)
+{
+	int i;
+
+	if (lapic == NULL) {
+		cprintf("proc_check: no timer to preempt processes with\n");
+		return;
+	}
+
+	// Put them all on our own run queue,
+	// for the other CPUs to pull away from us.
+	for (i = 0; i < PROC_NCHECK; i++) {
+		proc *p = proc_alloc(user_count, user_count_end - user_count,
+					PROC_CHECKCOUNT);
+		assert(p != NULL);
+		proc_check_procs[i] = p;
+		proc_ready(p);
+	}
+	proc_check_phase = 1;
+}
+
+// Read a proc_check() process's count, through the kernel's own mapping.
+static uint32_t
+proc_check_count(proc *p)
+{
+	pte_t *pte = pmap_walk(p->pdir, PROC_CHECKCOUNT, false);
+	assert(pte != NULL && (*pte & PTE_P));
+	return *(volatile uint32_t*) mem_ptr(PTE_ADDR(*pte));
+}
+
+// Called on each of the boot CPU's timer ticks while proc_check() is on.
+static void
+proc_check_tick(void)
+{
+	int i, ncpu = 0, npulls = 0;
+	cpu *c;
+
+	switch (proc_check_phase) {
+	case 1:	// Every process must start running...
+		for (i = 0; i < PROC_NCHECK; i++)
+			if ((proc_check_seen[i] =
+					proc_check_count(proc_check_procs[i])) == 0)
+				return;
+		proc_check_phase = 2;
+		return;
+
+	case 2:	// ...and keep going, which on one CPU takes preemption.
+		for (i = 0; i < PROC_NCHECK; i++)
+			if (proc_check_count(proc_check_procs[i])
+					== proc_check_seen[i])
+				return;
+		proc_check_phase = 3;
+		// fall through
+
+	case 3:	// If there are other CPUs, they must have pulled some.
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			ncpu += c->booted != 0;
+			npulls += percpu_of(c, proc_cpustats)->pulls;
+		}
+		if (ncpu > 1 && npulls == 0)
+			return;
+		proc_check_phase = 0;
+		proc_stats();
+		cprintf("proc_check() succeeded!\n");
+		done();		// That's all the checks there are.
+	}
+}
@@ -0,0 +1,82 @@
+/*
+ * Processes and their scheduling.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_PROC_H
+#define PIOS_KERN_PROC_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/vm.h>
+
+#include <kern/pmap.h>
+
+
+#define PROC_HZ		100	// Timer interrupts per second on each CPU
+#define PROC_TIMESLICE	1	// Ticks a process runs before preemption
+#define PROC_BALANCE	10	// Ticks between each CPU's load balancing
+
+// Each process's code is one read-only page here,
+// and its user stack is one page just below PROC_STACKHI.
+#define PROC_CODE	VM_USERLO
+#define PROC_STACKHI	VM_USERHI
+
+typedef enum proc_state {
+	PROC_STOP = 0,		// Not yet ready to run
+	PROC_READY,		// On some CPU's run queue
+	PROC_RUN,		// Running on some CPU
+} proc_state;
+
+typedef struct proc {
+	struct proc	*readynext;	// Next on its CPU's run queue
+	proc_state	state;
+	struct cpu	*runcpu;	// CPU it's queued on or running on
+	bool		pinned;		// Never migrate it to another CPU
+	int		ticks;		// Ticks used of its current timeslice
+	pde_t		*pdir;		// Its address space
+	trapframe	tf;		// Its user state while not running
+} proc;
+
+
+// Start this CPU's scheduler clock.
+void proc_init(void);
+
+// Create a process with an address space of its own and a user stack,
+// and copy the 'size' bytes of position-independent code at 'code'
+// into its code page, to start running in user mode
+// with 'arg' as its one argument.  The code must never return.
+// Returns NULL if out of memory.
+proc *proc_alloc(const void *code, size_t size, uint32_t arg);
+
+// Put a process on the current CPU's run queue.
+void proc_ready(proc *p);
+
+// Run processes from this CPU's run queue, round-robin,
+// pulling them from busier CPUs when we run out,
+// and doing background work or halting when there's nothing at all.
+void proc_sched(void) gcc_noreturn;
+
+// Handle a timer interrupt: preempt the current process
+// at the end of its timeslice if anything else is waiting,
+// and now and then even out the run queues.
+// Returns only if the interrupted code is to keep running.
+void proc_tick(trapframe *tf);
+
+// Print each CPU's scheduling counts.
+void proc_stats(void);
+
+// Start some processes to check the scheduler with,
+// and watch from the boot CPU's timer interrupts
+// that they all get to run, on all the CPUs.
+void proc_check(void);
+
+// Position-independent programs for proc_alloc() (see kern/usercode.S).
+extern char user_count[], user_count_end[];
+extern char user_trapcheck[], user_trapcheck_end[];
+
+#endif /* !PIOS_KERN_PROC_H */
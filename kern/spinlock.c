@@ -0,0 +1,296 @@
+/*
+ * Spin locks for multiprocessor mutual exclusion in the kernel.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Adapted from xv6 and PIOS.
+ */
+
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/debug.h>
+
+
+// Queue nodes for the MCS locks this CPU holds or is waiting for,
+// used like a stack: node[depth] is the next one free.
+typedef struct mcscpu {
+	mcsnode		node[CPU_MCSNEST];
+	int		depth;
+} mcscpu;
+static PERCPU mcscpu mcs_cpu;
+
+void
+spinlock_init_(spinlock *lk, const char *file, int line)
+{
+	lk->owner = lk->next = 0;
+	lk->file = file;
+	lk->line = line;
+	lk->cpu = NULL;
+	lk->eips[0] = 0;
+	lk->nacquire = lk->ncontend = 0;
+	lk->spincycles = 0;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spinlock_acquire(spinlock *lk)
+{
+	if (spinlock_holding(lk))
+		panic("recursive spinlock_acquire of lock from %s:%d",
+			lk->file, lk->line);
+
+	// Take a ticket by atomically incrementing 'next',
+	// which sits in the upper half of the word that starts at 'owner'.
+	// The locked xadd serializes, so once our ticket comes up,
+	// no loads or stores in the critical section
+	// can have been reordered ahead of it.
+	uint32_t old = xadd((volatile uint32_t*)&lk->owner, 1 << 16);
+	uint16_t ticket = old >> 16;
+	if ((uint16_t) old != ticket) {
+		// Wait our turn, reading the lock without writing it.
+		uint64_t t0 = rdtsc();
+		while (lk->owner != ticket)
+			pause();
+		lk->ncontend++;
+		lk->spincycles += rdtsc() - t0;
+	}
+	lk->nacquire++;
+
+	// Record info about lock acquisition for debugging.
+	lk->cpu = cpu_cur();
+	debug_trace(read_ebp(), lk->eips);
+}
+
+// Release the lock.
+void
+spinlock_release(spinlock *lk)
+{
+	if (!spinlock_holding(lk))
+		panic("spinlock_release of unheld lock from %s:%d",
+			lk->file, lk->line);
+
+	lk->eips[0] = 0;
+	lk->cpu = NULL;
+
+	// Only the holder ever changes 'owner', so a plain store
+	// passes the lock to the next ticket.  x86 doesn't reorder stores
+	// with earlier loads or stores, so once the compiler has emitted
+	// the critical section's, they are all visible before the release.
+	asm volatile("" : : : "memory");
+	lk->owner++;
+}
+
+// Check whether this cpu is holding the lock.
+int
+spinlock_holding(spinlock *lk)
+{
+	return lk->owner != lk->next && lk->cpu == cpu_cur();
+}
+
+void
+spinlock_stats(spinlock *lk)
+{
+	cprintf("lock %s:%d: %d acquired, %d contended, %d cycles/contended\n",
+		lk->file, lk->line, lk->nacquire, lk->ncontend,
+		lk->ncontend ? (uint32_t) (lk->spincycles / lk->ncontend) : 0);
+}
+
+
+void
+mcslock_init_(mcslock *lk, const char *file, int line)
+{
+	lk->tail = NULL;
+	lk->file = file;
+	lk->line = line;
+	lk->cpu = NULL;
+	lk->node = NULL;
+	lk->eips[0] = 0;
+	lk->nacquire = lk->ncontend = 0;
+	lk->spincycles = 0;
+}
+
+void
+mcslock_acquire(mcslock *lk)
+{
+	if (mcslock_holding(lk))
+		panic("recursive mcslock_acquire of lock from %s:%d",
+			lk->file, lk->line);
+
+	cpu *c = cpu_cur();
+	mcscpu *m = percpu_of(c, mcs_cpu);
+	if (m->depth == CPU_MCSNEST)
+		panic("mcslock_acquire: too many MCS locks held");
+	mcsnode *n = &m->node[m->depth++];
+	n->next = NULL;
+	n->waiting = 1;
+
+	// Join the end of the queue.  If someone was already there,
+	// link in behind them and spin on our own node until they're done.
+	mcsnode *pred = (mcsnode*) xchg((volatile uint32_t*)&lk->tail,
+					(uint32_t) n);
+	if (pred != NULL) {
+		uint64_t t0 = rdtsc();
+		pred->next = n;
+		while (n->waiting)
+			pause();
+		lk->ncontend++;
+		lk->spincycles += rdtsc() - t0;
+	}
+	lk->nacquire++;
+
+	// Record info about lock acquisition for debugging.
+	lk->cpu = c;
+	lk->node = n;
+	debug_trace(read_ebp(), lk->eips);
+}
+
+void
+mcslock_release(mcslock *lk)
+{
+	if (!mcslock_holding(lk))
+		panic("mcslock_release of unheld lock from %s:%d",
+			lk->file, lk->line);
+
+	mcscpu *m = percpu_ptr(mcs_cpu);
+	mcsnode *n = lk->node;
+	if (n != &m->node[m->depth-1])
+		panic("mcslock_release: MCS locks released out of order");
+	lk->eips[0] = 0;
+	lk->cpu = NULL;
+	lk->node = NULL;
+
+	// If nobody is queued behind us, just empty the queue - unless
+	// someone joins it in the meantime, in which case we have to wait
+	// for them to link in, and hand the lock to them directly.
+	// The locked cmpxchg and the plain store of 'waiting' both come
+	// after all the critical section's stores, as in spinlock_release().
+	asm volatile("" : : : "memory");
+	if (n->next == NULL) {
+		if (cmpxchg((volatile uint32_t*)&lk->tail, (uint32_t) n, 0)
+				== (uint32_t) n) {
+			m->depth--;
+			return;
+		}
+		while (n->next == NULL)
+			pause();
+	}
+	n->next->waiting = 0;
+	m->depth--;
+}
+
+int
+mcslock_holding(mcslock *lk)
+{
+	return lk->tail != NULL && lk->cpu == cpu_cur();
+}
+
+void
+mcslock_stats(mcslock *lk)
+{
+	cprintf("lock %s:%d: %d acquired, %d contended, %d cycles/contended\n",
+		lk->file, lk->line, lk->nacquire, lk->ncontend,
+		lk->ncontend ? (uint32_t) (lk->spincycles / lk->ncontend) : 0);
+}
+
+// Function that simply recurses to a specified depth.
+// The useless return value and volatile parameter are
+// so GCC doesn't collapse it via tail-call elimination.
+static int gcc_noinline
+spinlock_godeep(volatile int depth, spinlock* lk)
+{
+	if (depth == 0) {
+		spinlock_acquire(lk);
+		return 1;
+	}
+	return spinlock_godeep(depth-1, lk) * depth;
+}
+
+void
+spinlock_check(void)
+{
+	const int NUMLOCKS = 10;
+	const int NUMRUNS = 5;
+	int i, j, run;
+	const char *file = "spinlock_check";
+	spinlock locks[NUMLOCKS];
+
+	// Initialize the locks
+	for (i = 0; i < NUMLOCKS; i++)
+		spinlock_init_(&locks[i], file, 0);
+	// Make sure that all locks have CPU set to NULL initially
+	for (i = 0; i < NUMLOCKS; i++)
+		assert(locks[i].cpu == NULL);
+	// Make sure that all locks have the correct debug info.
+	for (i = 0; i < NUMLOCKS; i++)
+		assert(locks[i].file == file);
+
+	for (run = 0; run < NUMRUNS; run++) {
+		// Lock all locks
+		for (i = 0; i < NUMLOCKS; i++)
+			spinlock_godeep(i, &locks[i]);
+
+		// Make sure that all locks have the right CPU
+		for (i = 0; i < NUMLOCKS; i++)
+			assert(locks[i].cpu == cpu_cur());
+		// Make sure that all locks have holding correctly implemented.
+		for (i = 0; i < NUMLOCKS; i++)
+			assert(spinlock_holding(&locks[i]) != 0);
+		// Make sure that top i frames are somewhere in godeep.
+		for (i = 0; i < NUMLOCKS; i++)
+			for (j = 0; j <= i && j < DEBUG_TRACEFRAMES; j++)
+				assert(locks[i].eips[j] >=
+					(uint32_t)spinlock_godeep &&
+				       locks[i].eips[j] <
+					(uint32_t)spinlock_godeep+100);
+
+		// Release all locks
+		for (i = 0; i < NUMLOCKS; i++)
+			spinlock_release(&locks[i]);
+		// Make sure that the CPU has been cleared
+		for (i = 0; i < NUMLOCKS; i++)
+			assert(locks[i].cpu == NULL);
+		for (i = 0; i < NUMLOCKS; i++)
+			assert(locks[i].eips[0] == 0);
+		// Make sure that all locks have holding correctly implemented.
+		for (i = 0; i < NUMLOCKS; i++)
+			assert(spinlock_holding(&locks[i]) == 0);
+	}
+	for (i = 0; i < NUMLOCKS; i++)
+		assert(locks[i].nacquire == NUMRUNS &&
+			locks[i].ncontend == 0);
+
+	// MCS locks nest up to CPU_MCSNEST deep, each using the next
+	// of this CPU's queue nodes, and must be released in reverse order.
+	mcslock mlocks[CPU_MCSNEST];
+	mcscpu *m = percpu_ptr(mcs_cpu);
+	for (i = 0; i < CPU_MCSNEST; i++)
+		mcslock_init_(&mlocks[i], file, i);
+	for (run = 0; run < NUMRUNS; run++) {
+		assert(m->depth == 0);
+		for (i = 0; i < CPU_MCSNEST; i++) {
+			mcslock_acquire(&mlocks[i]);
+			assert(mlocks[i].node == &m->node[i]);
+			assert(mlocks[i].tail == &m->node[i]);
+		}
+		assert(m->depth == CPU_MCSNEST);
+		for (i = 0; i < CPU_MCSNEST; i++)
+			assert(mcslock_holding(&mlocks[i]));
+		for (i = CPU_MCSNEST-1; i >= 0; i--) {
+			mcslock_release(&mlocks[i]);
+			assert(mlocks[i].tail == NULL);
+			assert(!mcslock_holding(&mlocks[i]));
+		}
+	}
+	assert(m->depth == 0);
+	for (i = 0; i < CPU_MCSNEST; i++)
+		assert(mlocks[i].nacquire == NUMRUNS &&
+			mlocks[i].ncontend == 0);
+
+	cprintf("spinlock_check() succeeded!\n");
+}
@@ -0,0 +1,98 @@
+/*
+ * Spin locks for multiprocessor mutual exclusion in the kernel.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ *
+ * Adapted from xv6 and PIOS.
+ */
+
+#ifndef PIOS_KERN_SPINLOCK_H
+#define PIOS_KERN_SPINLOCK_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/debug.h>
+
+
+struct cpu;
+
+// Mutual exclusion lock for short critical sections: a ticket lock,
+// which hands itself to waiting CPUs in the order they arrived.
+// Each waiter takes the next ticket and spins until 'owner' reaches it.
+typedef struct spinlock {
+	volatile uint16_t owner;	// Ticket of the CPU holding the lock
+	volatile uint16_t next;		// Next ticket to hand out
+
+	// For debugging:
+	const char	*file;		// Source file where spinlock_init() called
+	int		line;		// Line number of spinlock_init()
+	struct cpu	*cpu;		// The cpu holding the lock
+	uint32_t	eips[DEBUG_TRACEFRAMES];	// Call stack that locked it
+
+	// Contention statistics, which only the holder updates.
+	uint32_t	nacquire;	// Number of times acquired
+	uint32_t	ncontend;	// ...that had to wait for another CPU
+	uint64_t	spincycles;	// Total cycles spent waiting
+} spinlock;
+
+// A waiting CPU's place in an MCS lock's queue (see below).
+typedef struct mcsnode {
+	struct mcsnode * volatile next;	// The CPU queued up behind us
+	volatile uint32_t waiting;	// Cleared when the lock is ours
+} mcsnode;
+
+// Queue lock for heavily contended critical sections (Mellor-Crummey
+// and Scott).  Waiting CPUs form a linked queue of mcsnodes, and each
+// spins on its own node until its predecessor hands over the lock,
+// so a release touches only the next CPU's cache line
+// instead of every waiter's.  Each CPU has a few nodes of its own,
+// in a per-CPU variable in kern/spinlock.c.
+typedef struct mcslock {
+	mcsnode * volatile tail;	// Last CPU in the queue, or NULL
+
+	// For debugging:
+	const char	*file;		// Source file where mcslock_init() called
+	int		line;		// Line number of mcslock_init()
+	struct cpu	*cpu;		// The cpu holding the lock
+	mcsnode		*node;		// ...and its queue node
+	uint32_t	eips[DEBUG_TRACEFRAMES];	// Call stack that locked it
+
+	// Contention statistics, which only the holder updates.
+	uint32_t	nacquire;	// Number of times acquired
+	uint32_t	ncontend;	// ...that had to wait for another CPU
+	uint64_t	spincycles;	// Total cycles spent waiting
+} mcslock;
+
+// Initialize a lock, recording where it was initialized for debugging.
+void spinlock_init_(spinlock *lk, const char *file, int line);
+#define spinlock_init(lk)	spinlock_init_(lk, __FILE__, __LINE__)
+
+// Acquire the lock, spinning until it is available.
+// Panics if the current CPU already holds it.
+void spinlock_acquire(spinlock *lk);
+
+// Release the lock.  Panics if the current CPU does not hold it.
+void spinlock_release(spinlock *lk);
+
+// Returns true if the current CPU holds the lock.
+int spinlock_holding(spinlock *lk);
+
+// Print a lock's contention statistics,
+// naming it by where it was initialized.
+void spinlock_stats(spinlock *lk);
+
+// The same operations for MCS locks.
+void mcslock_init_(mcslock *lk, const char *file, int line);
+#define mcslock_init(lk)	mcslock_init_(lk, __FILE__, __LINE__)
+void mcslock_acquire(mcslock *lk);
+void mcslock_release(mcslock *lk);
+int mcslock_holding(mcslock *lk);
+void mcslock_stats(mcslock *lk);
+
+// Check basic spinlock and MCS lock operation.
+void spinlock_check(void);
+
+#endif /* PIOS_KERN_SPINLOCK_H */
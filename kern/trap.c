@@ -13,9 +13,13 @@
 #include <inc/assert.h>
 
 #include <kern/cpu.h>
+#include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/cons.h>
 #include <kern/init.h>
+#include <kern/proc.h>
+
+#include <dev/lapic.h>
 
 
 // Interrupt descriptor table.  Must be built at run time because
@@ -37,10 +41,23 @@ trap_init_idt(void)
 {
 	 extern segdesc gdt[];
 	 int i;
+
+	// Every vector uses an interrupt gate, so that the kernel
+	// always runs with interrupts disabled, even when a trap
+	// from user mode brings it in: the per-CPU allocator caches,
+	// MCS queue nodes, and spinlocks all depend on that.
 	 for(i = 0; i < 20; i++) {
-	 	SETGATE(idt[i], 1, CPU_GDT_KCODE, vectors[i],3);
+	 	SETGATE(idt[i], 0, CPU_GDT_KCODE, vectors[i],3);
 	 }
-	 SETGATE(idt[30], 1, CPU_GDT_KCODE, vectors[30],3);
+	 SETGATE(idt[30], 0, CPU_GDT_KCODE, vectors[30],3);
+
+	// User code can't raise device and inter-processor interrupts with INT.
+	SETGATE(idt[T_IRQ0 + IRQ_SPURIOUS], 0, CPU_GDT_KCODE,
+		vectors[T_IRQ0 + IRQ_SPURIOUS], 0);
+	SETGATE(idt[T_LTIMER], 0, CPU_GDT_KCODE, vectors[T_LTIMER], 0);
+	SETGATE(idt[T_LERROR], 0, CPU_GDT_KCODE, vectors[T_LERROR], 0);
+	SETGATE(idt[T_TLBFLUSH], 0, CPU_GDT_KCODE, vectors[T_TLBFLUSH], 0);
+	SETGATE(idt[T_WAKEUP], 0, CPU_GDT_KCODE, vectors[T_WAKEUP], 0);
 	//panic("trap_init() not implemented.");
 }
 
@@ -125,6 +142,29 @@ trap(trapframe *tf)
 	// and some versions of GCC rely on DF being clear.
 	asm volatile("cld" ::: "cc");
 
+	// Page faults on copy-on-write pages are handled transparently.
+	if (tf->trapno == T_PGFLT)
+		pmap_pagefault(tf);
+
+	switch (tf->trapno) {
+	case T_TLBFLUSH:
+		pmap_tlbdrain();
+		lapic_eoi();
+		trap_return(tf);
+	case T_LTIMER:
+		lapic_eoi();
+		proc_tick(tf);		// may switch to another process
+		trap_return(tf);
+	case T_WAKEUP:		// just getting out of hlt is the point
+		lapic_eoi();
+		trap_return(tf);
+	case T_LERROR:
+		lapic_errintr();
+		trap_return(tf);
+	case T_IRQ0 + IRQ_SPURIOUS:
+		trap_return(tf);	// spurious interrupts need no EOI
+	}
+
 	// If this trap was anticipated, just use the designated handler.
 	cpu *c = cpu_cur();
 	if (c->recover)
@@ -161,21 +201,50 @@ trap_check_kernel(void)
 	cprintf("trap_check_kernel() succeeded!\n");
 }
 
-// Check for correct handling of traps from user mode.
-// Called from user() in kern/init.c, only in lab 1.
-// We assume the "current cpu" is always the boot cpu;
-// this true only because lab 1 doesn't start any other CPUs.
+// The traps user_trapcheck (see kern/usercode.S) causes, in order.
+static const int trap_check_user_traps[] = {
+	T_DIVIDE, T_BRKPT, T_OFLOW, T_BOUND, T_ILLOP, T_GPFLT, T_GPFLT,
+};
+#define TRAP_CHECK_NUSER \
+	(sizeof(trap_check_user_traps) / sizeof(trap_check_user_traps[0]))
+
+// Recovery handler for trap_check_user()'s process:
+// check each trap, then resume the process where it left the address for it.
+static void gcc_noreturn
+trap_check_user_recover(trapframe *tf, void *recoverdata)
+{
+	int *ntraps = recoverdata;
+
+	assert((tf->cs & 3) == 3);	// better be from user mode!
+	assert(*ntraps < TRAP_CHECK_NUSER);
+	assert(tf->trapno == trap_check_user_traps[*ntraps]);
+	assert(tf->esp > PROC_STACKHI - PAGESIZE && tf->esp <= PROC_STACKHI);
+	tf->eip = tf->regs.ebx;
+
+	if (++*ntraps == TRAP_CHECK_NUSER) {
+		cpu_cur()->recover = NULL;	// traps are real again
+		cprintf("trap_check_user() succeeded!\n");
+	}
+	trap_return(tf);
+}
+
+// Check for correct handling of traps from user mode,
+// by starting a process that causes them, pinned to this CPU
+// so that trap_check_user_recover() gets to see them.
 void
 trap_check_user(void)
 {
-	assert((read_cs() & 3) == 3);	// better be in user mode!
+	static int ntraps;
 
-	cpu *c = &cpu_boot;	// cpu_cur doesn't work from user mode!
-	c->recover = trap_check_recover;
-	trap_check(&c->recoverdata);
-	c->recover = NULL;	// No more mr. nice-guy; traps are real again
+	proc *p = proc_alloc(user_trapcheck,
+			user_trapcheck_end - user_trapcheck, 0);
+	assert(p != NULL);
+	p->pinned = true;
 
-	cprintf("trap_check_user() succeeded!\n");
+	cpu *c = cpu_cur();
+	c->recover = trap_check_user_recover;
+	c->recoverdata = &ntraps;
+	proc_ready(p);
 }
 
 void after_div0();
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Build the kernel with the memory allocator benchmarks enabled
+# (see kern/membench.c), run it under QEMU, and summarize the results.
+# Set NCPU to benchmark with more than one processor, e.g.:
+#	NCPU=4 sh misc/grade-membench.sh
+# The summary lines are easy to collect to track performance over time.
+
+ncpu=${NCPU-1}
+qemuopts="-smp $ncpu -hda obj/kern/kernel.img"
+. misc/grade-functions.sh
+
+timeout=60
+
+$make clean >/dev/null 2>&1
+$make DEFS=-DMEMBENCH >$out 2>$err
+run
+
+score=0
+
+pts=20; greptest "Memory:    " "mem_check() succeeded!"
+
+# Each benchmark prints "membench: <name> p50 <n> p99 <n> cycles".
+for bench in pair loop64 batch64 churn kmalloc
+do
+	pts=16
+	echo_n "`printf '%-11s' $bench:`"
+	nums=`grep "^membench: $bench " grade-out |
+		awk '{ printf(" p50=%s p99=%s", $4, $6) }'`
+	if [ -n "$nums" ]; then
+		pass "$ncpu cpu(s)$nums"
+	else
+		fail
+	fi
+done
+
+echo "Score: $score/100"
+
+# Clean up so the next build does not keep the benchmarks enabled.
+$make clean >/dev/null 2>&1
+
+if [ $score -lt 100 ]; then
+    exit 1
+fi